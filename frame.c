@@ -0,0 +1,55 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <avr/interrupt.h>
+#include "avr/io.h"
+
+#include "nixie.h"
+
+/*
+  Double buffered frame.
+
+  paint() draws into back buffer returned by frame_begin() and publishes
+  it with frame_commit(). Display ISR calls frame_flip() at the frame
+  boundary, which swaps buffers if a frame was committed. Thus main loop
+  never waits for display and partial frame is never shown.
+
+  frame_begin() revokes pending commit, so ISR never flips a buffer
+  which is being drawn. Latest committed frame wins.
+ */
+
+static char buf[2][FRAME_SIZE];
+static char * volatile front = buf[0], * volatile back = buf[1];
+static volatile char committed;
+
+char *
+frame_begin()
+{
+        committed = 0;
+        // front is stable now: start from currently displayed frame,
+        // so paint() may update it partially
+        memcpy(back, front, FRAME_SIZE);
+        return back;
+}
+
+void
+frame_commit()
+{
+        // memory barrier: writes to back buffer should happen before commit
+        __sync_synchronize();
+        committed = 1;
+}
+
+// display ISR only: returns new front buffer or NULL if there is nothing new
+char *
+frame_flip()
+{
+        if (!committed)
+                return NULL;
+
+        char *f = back;
+        back = front;
+        front = f;
+        committed = 0;
+        return f;
+}
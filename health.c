@@ -0,0 +1,184 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "avr/io.h"
+#include "avr/eeprom.h"
+#include <util/atomic.h>
+#include "util/crc16.h"
+
+#include "nixie.h"
+
+/*
+  Health counters.
+
+  Reset causes and log events are counted in a record at HEALTH_EEPROM,
+  so field failures can be ranked by frequency. Reset cause comes from
+  MCUSR, saved before watchdog_disable() clears it. For a watchdog reset
+  the address tick() last interrupted is kept as a hint where the CPU
+  was stuck, 0 if no sample survived the reset.
+
+  Record is saved in background with journal_put_byte(): right after
+  boot, and then at most once an hour if counters changed. Saved copy is
+  a snapshot, so ISRs may keep counting meanwhile. crc8 is the last byte
+  written, a torn record starts from zero.
+ */
+
+static struct health health, saved;
+static volatile char dirty;
+static unsigned char save_ix = sizeof saved; // next byte of saved to write
+static uint32_t save_period, save_left; // ticks
+
+static uint8_t
+health_crc(const struct health *h)
+{
+        const uint8_t *p = (const uint8_t *)h;
+        uint8_t crc = 0;
+        for (unsigned char i = 0; i < sizeof *h - 1; i++)
+                crc = _crc8_ccitt_update(crc, p[i]);
+        return crc;
+}
+
+static void
+health_save()
+{
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                memcpy(&saved, &health, sizeof saved);
+                dirty = 0;
+        }
+        saved.crc = health_crc(&saved);
+        save_ix = 0;
+}
+
+static unsigned char
+reset_cause(uint8_t mcusr)
+{
+        // power-on reset may come with brown-out flag set
+        if (mcusr & _BV(PORF))
+                return RESET_POWER;
+        if (mcusr & _BV(BORF))
+                return RESET_BROWNOUT;
+        if (mcusr & _BV(WDRF))
+                return RESET_WATCHDOG;
+        if (mcusr & _BV(EXTRF))
+                return RESET_EXTERNAL;
+        return RESET_OTHER;
+}
+
+// at boot, before interrupts are enabled; wdt_pc is a word address
+void
+health_init(uint8_t mcusr, uint16_t wdt_pc)
+{
+        eeprom_busy_wait();
+        eeprom_read_block(&health, (void *)HEALTH_EEPROM, sizeof health);
+        if (health.crc != health_crc(&health))
+                memset(&health, 0, sizeof health);
+
+        unsigned char cause = reset_cause(mcusr);
+        if (health.resets[cause] < 0xffff)
+                health.resets[cause]++;
+        memmove(&health.last[1], &health.last[0], sizeof health.last - sizeof health.last[0]);
+        health.last[0].cause = cause;
+        health.last[0].pc = cause == RESET_WATCHDOG ? wdt_pc << 1 : 0;
+
+        save_period = 3600UL * (F_CPU / 256 / timer0_prescaler) / tick_timer0_ovf;
+        save_left = save_period;
+        health_save();
+}
+
+// any context
+void
+health_event(unsigned char id)
+{
+        if (id >= LOG_EVENTS)
+                return;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                if (health.events[id] < 0xffff)
+                        health.events[id]++;
+                dirty = 1;
+        }
+}
+
+// main context, ticks passed since previous call
+void
+health_poll(unsigned char ticks)
+{
+        if (save_ix < sizeof saved) {
+                if (journal_put_byte((uint8_t *)HEALTH_EEPROM + save_ix, ((uint8_t *)&saved)[save_ix]))
+                        save_ix++;
+                return;
+        }
+        if (save_left > ticks) {
+                save_left -= ticks;
+                return;
+        }
+        save_left = save_period;
+        if (dirty)
+                health_save();
+}
+
+void
+health_read(struct health *h)
+{
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                memcpy(h, &health, sizeof *h);
+}
+
+void
+health_clear()
+{
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                memset(&health, 0, sizeof health);
+        health_save();
+}
+
+static const char cause_other[] PROGMEM = "other";
+static const char cause_power[] PROGMEM = "power-on";
+static const char cause_external[] PROGMEM = "external";
+static const char cause_brownout[] PROGMEM = "brown-out";
+static const char cause_watchdog[] PROGMEM = "watchdog";
+
+static PGM_P const cause_name[] PROGMEM = {
+        [RESET_OTHER] = cause_other,
+        [RESET_POWER] = cause_power,
+        [RESET_EXTERNAL] = cause_external,
+        [RESET_BROWNOUT] = cause_brownout,
+        [RESET_WATCHDOG] = cause_watchdog,
+};
+
+static const char event_i2c_error[] PROGMEM = "i2c error";
+static const char event_twi_reset[] PROGMEM = "twi reset";
+static const char event_op_dropped[] PROGMEM = "op dropped";
+static const char event_rtc_mismatch[] PROGMEM = "rtc mismatch";
+static const char event_sqw_lost[] PROGMEM = "sqw lost";
+
+static PGM_P const event_name[] PROGMEM = {
+        [LOG_I2C_ERROR] = event_i2c_error,
+        [LOG_TWI_RESET] = event_twi_reset,
+        [LOG_OP_DROPPED] = event_op_dropped,
+        [LOG_RTC_MISMATCH] = event_rtc_mismatch,
+        [LOG_SQW_LOST] = event_sqw_lost,
+};
+
+void
+health_print()
+{
+        struct health h;
+        health_read(&h);
+
+        printf_P(PSTR("resets:\n"));
+        for (unsigned char i = 0; i < RESET_CAUSES; i++)
+                printf_P(PSTR("  %-14S %u\n"), (PGM_P)pgm_read_word(&cause_name[i]), h.resets[i]);
+        printf_P(PSTR("events:\n"));
+        for (unsigned char i = 0; i < LOG_EVENTS; i++)
+                printf_P(PSTR("  %-14S %u\n"), (PGM_P)pgm_read_word(&event_name[i]), h.events[i]);
+        printf_P(PSTR("last resets:"));
+        for (unsigned char i = 0; i < HEALTH_LAST; i++) {
+                printf_P(PSTR(" %S"), (PGM_P)pgm_read_word(&cause_name[h.last[i].cause % RESET_CAUSES]));
+                if (h.last[i].cause == RESET_WATCHDOG)
+                        printf_P(PSTR(" at 0x%04x"), h.last[i].pc);
+        }
+        printf_P(PSTR("\n"));
+}
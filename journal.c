@@ -0,0 +1,185 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <avr/interrupt.h>
+#include "avr/io.h"
+#include "avr/eeprom.h"
+#include <util/atomic.h>
+#include "util/crc16.h"
+
+#include "nixie.h"
+#include "load.h"
+
+/*
+  Config journal.
+
+  EEPROM is a ring of fixed size records: config followed by 16-bit
+  sequence number, config.crc covers the rest of the record. A new record
+  goes to the slot after the newest one, so cells wear evenly, and only
+  if config differs from the newest record.
+
+  EE_READY_vect writes the record byte by byte, main loop never waits for
+  EEPROM. Bytes already holding the right value are skipped. crc is the
+  last byte written: a record torn by reset fails the check and the
+  previous one is used at boot. A config written while another record is
+  still in flight waits in `next`, only the latest one is kept.
+
+  Firmware before the journal kept one config at LEGACY_CONFIG: crc and
+  the fields up to fade_mode. If no journal record is valid, that one is
+  used and seeded into the journal, in a slot clear of it: a reset before
+  the seed is complete finds the old record again.
+ */
+
+#ifndef JOURNAL_START
+#define JOURNAL_START 0
+#endif
+#ifndef JOURNAL_END
+#define JOURNAL_END HEALTH_EEPROM
+#endif
+
+struct record {
+        struct config cfg;
+        uint16_t seq;
+};
+
+#define SLOTS ((JOURNAL_END - JOURNAL_START) / sizeof(struct record))
+
+#define LEGACY_CONFIG 13
+#define LEGACY_SIZE 9 // crc .. fade_mode
+
+static struct record rec, next; // rec is being written by EE_READY_vect
+static volatile unsigned char ix = sizeof rec; // next byte of rec to write
+static volatile char next_ready;
+static volatile unsigned char slot = SLOTS - 1; // slot of rec
+static struct record newest; // main context only
+static char have_newest;
+
+static uint8_t
+record_crc(const struct record *r)
+{
+        const uint8_t *p = (const uint8_t *)r;
+        uint8_t crc = 0;
+        for (unsigned char i = 1; i < sizeof *r; i++)
+                crc = _crc8_ccitt_update(crc, p[i]);
+        return crc;
+}
+
+static uint8_t *
+slot_addr(unsigned char s)
+{
+        return (uint8_t *)(JOURNAL_START + s * sizeof(struct record));
+}
+
+ISR(EE_READY_vect)
+{
+        IDLE_WAKE();
+        unsigned char i = ix;
+        if (i == sizeof rec) {
+                if (!next_ready) {
+                        EECR &= ~_BV(EERIE);
+                        return;
+                }
+                memcpy(&rec, &next, sizeof rec);
+                next_ready = 0;
+                slot = slot + 1 == SLOTS ? 0 : slot + 1;
+                i = 0;
+        }
+        // bytes 1..n-1 first, crc at 0 last
+        unsigned char off = i + 1 == sizeof rec ? 0 : i + 1;
+        // EEPE is clear here, so it does not wait
+        eeprom_update_byte(slot_addr(slot) + off, ((uint8_t *)&rec)[off]);
+        ix = i + 1;
+}
+
+// Old config record over defaults in cfg, returns 0 if it fails crc.
+static char
+legacy_read(struct config *cfg)
+{
+        uint8_t buf[LEGACY_SIZE];
+        uint8_t crc = 0;
+
+        eeprom_read_block(buf, (void *)LEGACY_CONFIG, sizeof buf);
+        for (unsigned char i = 1; i < sizeof buf; i++)
+                crc = _crc8_ccitt_update(crc, buf[i]);
+        if (buf[0] != crc)
+                return 0;
+        memcpy(cfg, buf, sizeof buf);
+        return 1;
+}
+
+// Finds newest valid record, or migrates the pre-journal one, returns 0
+// if there is neither. Call once at boot.
+char
+journal_read(struct config *cfg)
+{
+        struct record r;
+
+        eeprom_busy_wait();
+        for (unsigned char s = 0; s < SLOTS; s++) {
+                eeprom_read_block(&r, slot_addr(s), sizeof r);
+                if (r.cfg.crc != record_crc(&r))
+                        continue;
+                // sequence numbers wrap, only distance matters
+                if (have_newest && (int16_t)(r.seq - newest.seq) <= 0)
+                        continue;
+                memcpy(&newest, &r, sizeof r);
+                have_newest = 1;
+                slot = s;
+        }
+        if (have_newest) {
+                memcpy(cfg, &newest.cfg, sizeof *cfg);
+                return 1;
+        }
+
+        if (!legacy_read(cfg))
+                return 0;
+        // journal_write() takes the slot after this one
+        slot = (LEGACY_CONFIG + LEGACY_SIZE - JOURNAL_START + sizeof(struct record) - 1)
+                / sizeof(struct record) - 1;
+        journal_write(cfg);
+        return 1;
+}
+
+// Main context: writes one byte outside of journal if EEPROM and journal
+// are idle, returns 0 if caller should try again later. EE_READY_vect
+// never waits for a write started here: journal_write() enables it and
+// it runs once EEPE is clear.
+char
+journal_put_byte(uint8_t *addr, uint8_t val)
+{
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                if (ix != sizeof rec || next_ready || !eeprom_is_ready())
+                        return 0;
+                // only a changed byte starts a write
+                eeprom_update_byte(addr, val);
+        }
+        return 1;
+}
+
+// Queues cfg as the new newest record, unless it is unchanged. Never blocks.
+void
+journal_write(const struct config *cfg)
+{
+        if (have_newest && memcmp((const char *)cfg + 1, (const char *)&newest.cfg + 1,
+                                  sizeof *cfg - 1) == 0)
+                return;
+
+        struct record r;
+        memcpy(&r.cfg, cfg, sizeof *cfg);
+        r.seq = newest.seq + 1;
+        r.cfg.crc = record_crc(&r);
+        memcpy(&newest, &r, sizeof r);
+        have_newest = 1;
+
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                if (ix < sizeof rec) {
+                        memcpy(&next, &r, sizeof r);
+                        next_ready = 1;
+                } else {
+                        memcpy(&rec, &r, sizeof r);
+                        slot = slot + 1 == SLOTS ? 0 : slot + 1;
+                        ix = 0;
+                        EECR |= _BV(EERIE);
+                }
+        }
+}
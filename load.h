@@ -0,0 +1,25 @@
+#ifndef LOAD_H
+#define LOAD_H
+
+/*
+  CPU load accounting, reported by stats_print().
+
+  idle() is the only place the CPU sleeps. It counts TCNT0 from sleep
+  until the ISR which woke the CPU started: that ISR stamps TCNT0 with
+  IDLE_WAKE(), so its own time and everything after it counts as busy.
+  Every ISR starts with IDLE_WAKE(), one missing is counted idle until
+  it returns.
+ */
+
+extern volatile unsigned char idle_sleeping, idle_wake;
+
+void idle(); // sleep until interrupt, call with interrupts disabled
+
+#define IDLE_WAKE() do { \
+        if (idle_sleeping) { \
+                idle_wake = TCNT0; \
+                idle_sleeping = 0; \
+        } \
+} while (0)
+
+#endif
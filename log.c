@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "avr/io.h"
+#include <util/atomic.h>
+
+#include "nixie.h"
+
+/*
+  Deferred log.
+
+  log_event() stores compact binary record (event id + 2 args) and may be
+  called from any context, including ISRs: record is written with
+  interrupts disabled for a few cycles, so there are no partially written
+  records. log_flush() formats records with printf_P() from main context.
+  If the ring is full, the record is dropped and counted. Every event is
+  also counted in EEPROM by health.c.
+ */
+
+#ifndef LOG_RING_BITS
+#define LOG_RING_BITS 4
+#endif
+#define LOG_RING_MASK (_BV(LOG_RING_BITS) - 1)
+
+static struct {
+        unsigned char id, a, b;
+} ring[_BV(LOG_RING_BITS)];
+static volatile unsigned char r, w, dropped;
+
+static const char fmt_i2c_error[] PROGMEM = "I2C error: got 0x%02x\n";
+static const char fmt_twi_reset[] PROGMEM = "I2C timeout, TWI reset\n";
+static const char fmt_op_dropped[] PROGMEM = "op 0x%02x dropped, op ring is full\n";
+static const char fmt_rtc_mismatch[] PROGMEM = "RTC resync: local sec %02x, RTC sec %02x\n";
+static const char fmt_sqw_lost[] PROGMEM = "no SQW edges, polling RTC\n";
+
+static PGM_P const fmt[] PROGMEM = {
+        [LOG_I2C_ERROR] = fmt_i2c_error,
+        [LOG_TWI_RESET] = fmt_twi_reset,
+        [LOG_OP_DROPPED] = fmt_op_dropped,
+        [LOG_RTC_MISMATCH] = fmt_rtc_mismatch,
+        [LOG_SQW_LOST] = fmt_sqw_lost,
+};
+
+void
+log_event(unsigned char id, unsigned char a, unsigned char b)
+{
+        // counted even if the record is dropped
+        health_event(id);
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                unsigned char e = w;
+                if (((e + 1) & LOG_RING_MASK) == r) {
+                        if (dropped < 0xff)
+                                dropped++;
+                        return;
+                }
+                ring[e].id = id;
+                ring[e].a = a;
+                ring[e].b = b;
+                w = (e + 1) & LOG_RING_MASK;
+        }
+}
+
+// main context only
+void
+log_flush()
+{
+        while (r != w) {
+                unsigned char s = r;
+                printf_P((PGM_P)pgm_read_word(&fmt[ring[s].id]), ring[s].a, ring[s].b);
+                r = (s + 1) & LOG_RING_MASK;
+        }
+
+        if (dropped) {
+                cli();
+                unsigned char n = dropped;
+                dropped = 0;
+                sei();
+                printf_P(PSTR("log: %u messages dropped\n"), n);
+        }
+}
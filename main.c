@@ -1,31 +1,79 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
 
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include "avr/io.h"
 #include "avr/wdt.h"
-#include "avr/eeprom.h"
+#include "avr/sleep.h"
 #include <util/delay.h>
-#include <util/twi.h>
+#include <util/atomic.h>
 #include "util/crc16.h"
 
 #include "usart/uart.h"
+#include "twi/twi.h"
 #include "nixie.h"
+#include "profile.h"
+#include "load.h"
+
+// survive reset: MCUSR before it is cleared, and where the last tick()
+// interrupted the CPU, word address, valid if wdt_pc_check is its complement
+static uint8_t reset_mcusr __attribute__((section(".noinit")));
+static uint16_t wdt_pc __attribute__((section(".noinit")));
+static uint16_t wdt_pc_check __attribute__((section(".noinit")));
 
 void __attribute__((naked,section(".init3")))
 watchdog_disable(void)
 {
+        reset_mcusr = MCUSR;
         MCUSR = 0;
         wdt_disable();
 }
 
+#define STACK_PAINT 0xc5
+extern char __heap_start, __stack, *__brkval;
+
+// Fills RAM from the end of .bss up to RAMEND with STACK_PAINT.
+// Runs before stack is used and before .data/.bss are initialized.
+void __attribute__((naked,used,section(".init1")))
+stack_paint(void)
+{
+        __asm volatile(
+                "       ldi r30, lo8(__heap_start)\n"
+                "       ldi r31, hi8(__heap_start)\n"
+                "       ldi r24, %0\n"
+                "       ldi r25, hi8(__stack)\n"
+                "       rjmp 2f\n"
+                "1:     st Z+, r24\n"
+                "2:     cpi r30, lo8(__stack)\n"
+                "       cpc r31, r25\n"
+                "       brlo 1b\n"
+                "       breq 1b\n"
+                :: "i" (STACK_PAINT));
+}
+
+// bytes between heap top and the deepest stack seen so far
+static uint16_t
+stack_free()
+{
+        const char *p = __brkval ? __brkval : &__heap_start;
+        const char *sp = (const char *)SP;
+        uint16_t n = 0;
+        while (p + n < sp && p[n] == STACK_PAINT)
+                n++;
+        return n;
+}
+
+static const char version[] PROGMEM = VERSION;
+
 struct config config = {
         .tube_pwm_freq = 15, // 150Hz
         .tube_pwm_duty = 70,
         .antipoison_start = 2,
         .antipoison_duration = 2,
+        .tube_trim = { 100, 100, 100 },
+        .antipoison_speed = 50,
 };
 
 static struct time {
@@ -40,123 +88,204 @@ static struct time {
         unsigned char year;
 } time;
 
+#define BCD(n) (((n) / 10) << 4 | (n) % 10)
+#define BCD10(n) BCD(n), BCD(n + 1), BCD(n + 2), BCD(n + 3), BCD(n + 4), \
+                 BCD(n + 5), BCD(n + 6), BCD(n + 7), BCD(n + 8), BCD(n + 9)
+static const uint8_t bcd_table[100] PROGMEM = {
+        BCD10(0), BCD10(10), BCD10(20), BCD10(30), BCD10(40),
+        BCD10(50), BCD10(60), BCD10(70), BCD10(80), BCD10(90),
+};
+
+// 99 max binary, larger values are clamped
 static uint8_t
 bin2bcd(uint8_t bin)
 {
-        if (bin == 0)
-                return 0;
-
-        uint8_t bit = 0x40; //  99 max binary
-        while ((bin & bit) == 0) // skip to MSB
-                bit >>= 1;
-
-        uint8_t bcd = 0;
-        uint8_t carry = 0;
-        while (1) {
-                bcd <<= 1;
-                bcd += carry; // carry 6s to next BCD digits (10 + 6 = 0x10 = LSB of next BCD digit)
-                if (bit & bin)
-                        bcd |= 1;
-                bit >>= 1;
-                if (bit == 0)
-                        return bcd;
-                carry = ((bcd + 0x33) & 0x88) >> 1; // carrys: 8s -> 4s
-                carry += carry >> 1; // carrys 6s
-        }
-        return bcd;
+        return pgm_read_byte(&bcd_table[bin > 99 ? 99 : bin]);
 }
 
+// hardware multiplier makes it cheaper than a table lookup
 static uint8_t
 bcd2bin(uint8_t bcd)
 {
         return (bcd >> 4) * 10 + (bcd & 0xf);
 }
 
+// Timer1 runs in fast PWM mode 15: TOP is OCR1A, and OCR1A/OCR1B are
+// double buffered, both copied at BOTTOM. Writing them in the same period
+// switches frequency on a period boundary, a TOP below TCNT1 can't make
+// the counter run to 0xffff.
+void
+pwm_set(uint16_t top, uint16_t compare)
+{
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                // Both writes must land between the same two BOTTOMs. Active
+                // TOP can't be read back (OCR1A reads the buffer), so wait
+                // for a count edge instead: the next one is 64 cycles away,
+                // even if it is BOTTOM. Waits one count at most.
+                if (TCCR1B & (_BV(CS12)|_BV(CS11)|_BV(CS10))) {
+                        uint16_t t = TCNT1;
+                        while (TCNT1 == t)
+                                ;
+                }
+                OCR1A = top;
+                OCR1B = compare;
+        }
+}
+
+/*
+  Ops for main loop, pushed by buttons, UART, TWI_vect and INT0_vect.
 
-#define OP_RING_BITS 3
-#define OP_RING_MASK (_BV(OP_RING_BITS)-1)
-static volatile char op_ring[_BV(OP_RING_BITS)], opr;
-static volatile char opw;
+  REFRESH is not queued: it only says "display is stale", so it is a flag
+  taken after queued ops, and a burst of them is one redraw. A repeated
+  long press equal to the newest queued op is coalesced too: autorepeat
+  must not pile up behind a slow refresh() and run on after release.
+
+  Every op carries tick() count of its push, pop_op() tracks the worst
+  queueing latency. stats_print() reports it with drop/coalesce counters.
+ */
+#define LONG_PRESS _BV(7) // op flag
+
+#ifndef EVENT_QUEUE_BITS
+#define EVENT_QUEUE_BITS 3
+#endif
+#define EVENT_QUEUE_MASK (_BV(EVENT_QUEUE_BITS) - 1)
+
+struct event {
+        char op;
+        uint16_t tick;
+};
+
+static volatile uint16_t ticks;
+static struct event event_queue[_BV(EVENT_QUEUE_BITS)];
+static volatile unsigned char event_r, event_w;
+static volatile char refresh_pending;
+static uint16_t refresh_tick; // of oldest pending REFRESH
+static volatile uint16_t events_dropped, events_coalesced;
+static uint16_t event_latency_max; // ticks, main context only
 
 static char
-pop_op()
+events_empty()
 {
-        if (opr == opw) return NOP;
-        enum op op = op_ring[opr];
-        opr = (opr + 1) & OP_RING_MASK;
-        return op;
+        return event_r == event_w && !refresh_pending;
 }
 
-static void
-push_op(char op)
+static char
+pop_op()
 {
-        if (((opw + 1) & OP_RING_MASK) == opr) // ring buffer is full
-                return;
-        op_ring[opw] = op;
-        opw = (opw + 1) & OP_RING_MASK;
-}
+        bottom_half();
+
+        struct event e;
+        unsigned char r = event_r;
+        if (r != event_w) {
+                // entry is read before the slot is handed back to producers
+                __sync_synchronize();
+                e = event_queue[r];
+                __sync_synchronize();
+                event_r = (r + 1) & EVENT_QUEUE_MASK;
+        } else if (refresh_pending) {
+                ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                        e.op = REFRESH;
+                        e.tick = refresh_tick;
+                        refresh_pending = 0;
+                }
+        } else {
+                return NOP;
+        }
 
-static void
-i2c_init()
-{
-        // DS3231 supports upto 400kHz I2C
-        TWBR = (F_CPU / 400000UL - 16) / 2;
+        uint16_t latency;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                latency = ticks - e.tick;
+        if (latency > event_latency_max)
+                event_latency_max = latency;
+        return e.op;
 }
 
-#define DS3231_ADDR 0x68
-
+// called from main context, TWI_vect and INT0_vect
 static void
-ds3231_sync()
+push_op(char op)
 {
-        wdt_reset();
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                if (op == REFRESH) {
+                        if (refresh_pending) {
+                                events_coalesced++;
+                        } else {
+                                refresh_tick = ticks;
+                                refresh_pending = 1;
+                        }
+                        return;
+                }
 
-#define i2c_op(bit, cond)                                               \
-        TWCR = bit|_BV(TWEN)|_BV(TWINT);                                \
-        loop_until_bit_is_set(TWCR, TWINT);                             \
-        if ((TWSR & 0xf8) != cond) {                                    \
-                printf("I2C error: expected "#cond" = 0x%02x, got 0x%02x\n", cond, TWSR & 0xf8); \
-                goto out;                                               \
+                unsigned char w = event_w;
+                unsigned char newest = (w - 1) & EVENT_QUEUE_MASK;
+                if ((op & LONG_PRESS) && w != event_r && event_queue[newest].op == op) {
+                        events_coalesced++;
+                        return;
+                }
+                if (((w + 1) & EVENT_QUEUE_MASK) == event_r) { // queue is full
+                        events_dropped++;
+                        log_event(LOG_OP_DROPPED, op, 0);
+                        return;
+                }
+                event_queue[w].op = op;
+                event_queue[w].tick = ticks;
+                // entry is complete before consumer can see it
+                __sync_synchronize();
+                event_w = (w + 1) & EVENT_QUEUE_MASK;
         }
-        // reset TW state
-        TWCR = 0;
+}
 
-        // Send start condition
-        i2c_op(_BV(TWSTA), TW_START);
+#define DS3231_ADDR 0x68
 
-        // Send slave address, I2C Write
-        TWDR = DS3231_ADDR << 1;
-        i2c_op(0, TW_MT_SLA_ACK);
+/*
+  With config.rtc_sqw DS3231 outputs 1Hz square wave on INT0 (PD2), its
+  falling edge is when the seconds register increments. Time is counted
+  locally by INT0_vect and RTC is read only every RTC_RESYNC seconds, at
+  midnight and after a write. If there were no edges for SQW_TIMEOUT ticks
+  (line not wired), RTC is polled on every tick as before. Off by default:
+  not every board has SQW wired, and control register is left alone until
+  rtc_sqw is set.
+ */
+#define RTC_RESYNC 64
+#define SQW_TIMEOUT 200 // ticks, 2..3s depending on board
+#define DS3231_CONTROL 0x0e
+#define DS3231_CONTROL_SQW_1HZ 0x00 // oscillator on, INTCN=0, RS=1Hz
+#define DS3231_CONTROL_DEFAULT 0x1c // power-on value: INTCN=1, square wave off
+
+static volatile unsigned char sqw_edges, sqw_silent = SQW_TIMEOUT, rtc_resync;
+static unsigned char sqw_read_edges; // sqw_edges when read request was submitted
+static uint16_t rtc_mismatch; // local time differed from RTC on resync
 
-        // Position to the register 00h
-        TWDR = 0;
-        i2c_op(0, TW_MT_DATA_ACK);
+static char
+sqw_active()
+{
+        return sqw_silent < SQW_TIMEOUT;
+}
 
-        unsigned char *w = &time.sec;
-        if (time.dirty) {
-                for (char i = 0; i < sizeof time - 1; i++) {
-                        TWDR = *w++;
-                        i2c_op(_BV(TWEA), TW_MT_DATA_ACK);
-                }
-                time.dirty = 0;
-        } else {
-                // Send repeated start
-                i2c_op(_BV(TWSTA), TW_REP_START);
+static unsigned char ds3231_buf[sizeof time - 1];
 
-                // Send slave address, I2C read
-                TWDR = (DS3231_ADDR << 1) + 1;
-                i2c_op(0, TW_MR_SLA_ACK);
+// called from TWI_vect
+static void
+ds3231_done(struct twi_req *req)
+{
+        if (req->status == TWI_ERROR)
+                log_event(LOG_I2C_ERROR, req->twsr, 0);
+        if (req->status != TWI_DONE || (req->flags & TWI_READ) == 0)
+                return;
 
-                for (char i = 0; i < sizeof time - 1; i++) {
-                        i2c_op(_BV(TWEA), TW_MR_DATA_ACK);
-                        *w++ = TWDR;
-                }
-                // Last byte is nack
-                i2c_op(0, TW_MR_DATA_NACK);
+        // time was changed by user while read was in flight, next sync will write it
+        if (time.dirty)
+                return;
+        // second ticked while reading, registers may be from before the edge
+        if (sqw_read_edges != sqw_edges) {
+                rtc_resync = 1;
+                return;
         }
-out:
-        // Send stop
-        TWCR = _BV(TWEN)|_BV(TWINT)|_BV(TWSTO);
-#undef i2c_op
+        // sec, min, hour
+        if (sqw_active() && memcmp(&time.sec, ds3231_buf, 3) != 0) {
+                rtc_mismatch++;
+                log_event(LOG_RTC_MISMATCH, time.sec, ds3231_buf[0]);
+        }
+        memcpy(&time.sec, ds3231_buf, sizeof ds3231_buf);
 
         static char prev_sec;
         if (prev_sec != time.sec) {
@@ -165,62 +294,225 @@ out:
         }
 }
 
-#define LONG_PRESS _BV(7)
+static struct twi_req ds3231_req = {
+        .addr = DS3231_ADDR,
+        .reg = 0, // registers 00h..06h: sec, min, hour, day, date, month, year
+        .len = sizeof ds3231_buf,
+        .buf = ds3231_buf,
+        .done = ds3231_done,
+};
+
+// CMD_SET_TIME_AT: BCD time written to RTC when deadline is reached
+static struct {
+        unsigned char armed;
+        unsigned char hour, min, sec;
+        uint16_t tick, sub; // deadline, see stamp_now()
+} set_at;
 
-struct button_state {
-        char counter;
-        char pressed;
-        char short_press;
-        char long_press;
+static unsigned char ds3231_control = DS3231_CONTROL_DEFAULT; // 0xff: rewrite
+
+static struct twi_req ds3231_control_req = {
+        .addr = DS3231_ADDR,
+        .reg = DS3231_CONTROL,
+        .len = 1,
+        .buf = &ds3231_control,
 };
+
+// returns 1 on wrap
+static char
+bcd_inc(unsigned char *bcd, unsigned char wrap)
+{
+        (*bcd)++;
+        if ((*bcd & 0x0f) > 9)
+                *bcd += 6;
+        if (*bcd < wrap)
+                return 0;
+        *bcd = 0;
+        return 1;
+}
+
+ISR(INT0_vect)
+{
+        IDLE_WAKE();
+        PROFILE_SCOPE(PROF_INT0);
+        sqw_silent = 0;
+        sqw_edges++;
+
+        // write is pending, RTC restarts its second when it's done
+        if (time.dirty)
+                return;
+
+        if (bcd_inc(&time.sec, 0x60) && bcd_inc(&time.min, 0x60)) {
+                unsigned char hour = time.hour;
+                if (bcd_inc(&hour, 0x24))
+                        rtc_resync = 1; // date changed
+                time.hour = hour;
+        }
+        if (sqw_edges % RTC_RESYNC == 0)
+                rtc_resync = 1;
+        push_op(REFRESH);
+}
+
+// ds3231_req must not be pending
 static void
-button_decode(unsigned char mask, struct button_state *button)
-{
-        const char button_max = 10;
-
-        if (mask) {
-                if (button->counter < button_max)
-                        button->counter++;
-                if (button->counter == button_max) {
-                        if (button->pressed < 0xff)
-                                button->pressed++;
-                        if (button->pressed == 53)
-                                button->long_press = 1;
-                }
+ds3231_write()
+{
+        memcpy(ds3231_buf, &time.sec, sizeof ds3231_buf);
+        time.dirty = 0;
+        ds3231_req.flags = 0;
+        rtc_resync = 1; // read back after write
+        twi_submit(&ds3231_req);
+}
+
+// noinline: keep it a separate symbol, so `make bench` can measure it
+static void __attribute__((noinline))
+ds3231_sync()
+{
+        PROFILE_SCOPE(PROF_DS3231_SYNC);
+        wdt_reset();
+
+        if (!config.rtc_sqw) {
+                EIMSK &= ~_BV(INT0);
+                sqw_silent = SQW_TIMEOUT;
         } else {
-                if (button->counter > 0)
-                        button->counter--;
-                if (button->counter == 0 && button->pressed) {
-                        if (button->pressed < 50)
-                                button->short_press = 1;
-                        button->pressed = 0;
-                }
+                EIMSK |= _BV(INT0);
+                if (sqw_active() && ++sqw_silent == SQW_TIMEOUT)
+                        log_event(LOG_SQW_LOST, 0, 0);
         }
+
+        // previous transaction is still running, give it ~250ms before kicking TWI
+        static char busy;
+        if (ds3231_req.status == TWI_PENDING || ds3231_control_req.status == TWI_PENDING) {
+                if (++busy < 25)
+                        return;
+                twi_reset();
+                log_event(LOG_TWI_RESET, 0, 0);
+        }
+        busy = 0;
+
+        unsigned char control = config.rtc_sqw ? DS3231_CONTROL_SQW_1HZ : DS3231_CONTROL_DEFAULT;
+        if (ds3231_control != control || ds3231_control_req.status == TWI_ERROR) {
+                ds3231_control = control;
+                if (!twi_submit(&ds3231_control_req))
+                        ds3231_control = 0xff;
+        }
+
+        if (time.dirty) {
+                ds3231_write();
+        } else if (set_at.armed || (sqw_active() && !rtc_resync)) {
+                // no read may be in flight when set_at deadline comes
+                return;
+        } else {
+                ds3231_req.flags = TWI_READ;
+                rtc_resync = 0;
+                sqw_read_edges = sqw_edges;
+                twi_submit(&ds3231_req);
+        }
+}
+
+/*
+  Buttons are debounced all at once: bit n of ct0/ct1 is a 2-bit counter
+  for the button at bit n of button_read() mask. A counter runs while
+  the sample differs from the debounced state and resets when it is equal,
+  so a button changes state after 4 equal samples (~40ms).
+
+  Gesture is everything from the first press until all buttons are up:
+    - released before LONG_TICKS: short press of the chord, the mask of
+      all buttons pressed during the gesture;
+    - held for LONG_TICKS without change: long press of the held mask,
+      UP and DOWN alone then repeat every REPEAT_TICKS.
+  MODE, or UP and DOWN together, is MODE.
+
+  While nothing is pressed scanning stops: tick() does not sample the
+  buttons and board pin change interrupt calls button_wake() on press.
+ */
+#define LONG_TICKS 53
+#define REPEAT_TICKS 3
+
+static struct {
+        unsigned char ct0, ct1; // vertical counters
+        unsigned char state; // debounced mask
+        unsigned char chord; // buttons pressed since gesture began
+        unsigned char held; // ticks since state changed
+        unsigned char fired; // long press sent in this gesture
+} btn = { 0xff, 0xff };
+
+static volatile char buttons_awake = 1;
+static volatile unsigned char button_sample;
+
+// returns buttons which changed state
+static unsigned char
+button_debounce(unsigned char sample)
+{
+        unsigned char i = btn.state ^ sample;
+        btn.ct0 = ~(btn.ct0 & i);
+        btn.ct1 = btn.ct0 ^ (btn.ct1 & i);
+        i &= btn.ct0 & btn.ct1; // counter wrapped around
+        btn.state ^= i;
+        return i;
+}
+
+static char
+button_op(unsigned char mask)
+{
+        if ((mask & MODE) || (mask & (UP|DOWN)) == (UP|DOWN))
+                return MODE;
+        return mask;
 }
 
+// called from board pin change ISR
+void
+button_wake()
+{
+        button_irq(0);
+        // no stale sample from before sleep: it would put buttons back to sleep
+        button_sample = button_read();
+        buttons_awake = 1;
+}
+
+static void stats_print();
+static void usage_tick(unsigned char n);
+static char proto_input(unsigned char c);
+static void proto_tick();
+
+static void uart_command(char c);
+
+// called on every bottom_half(), not once per tick, so frame timing
+// seen by proto_input() is close to the time bytes were received
 static void
-uart_read()
+uart_read(unsigned char n)
 {
         // ignore keyboard during ~10s after boot
         // if uart is connected to something like esp_link,
         // it will read garbage produced by esp
         static int j = 1000;
         if (j > 0) {
-                j--;
+                j -= n;
                 // discard any buffered data
                 while (!uart_read_would_block())
                         getchar();
                 return;
         }
         if (j == 0) {
-                printf("ready to accept input\n");
+                printf_P(PSTR("ready to accept input\n"));
                 j = -1;
         }
 
-        if (uart_read_would_block())
-                return;
+        while (n--)
+                proto_tick();
+        while (!uart_read_would_block()) {
+                unsigned char c = getchar();
+                if (proto_input(c))
+                        continue;
+                uart_command(c);
+        }
+}
 
-        switch (getchar()) {
+// single character commands, they emulate buttons
+static void
+uart_command(char c)
+{
+        switch (c) {
         case 'u':
                 push_op(UP);
                 break;
@@ -233,55 +525,236 @@ uart_read()
         case 'M':
                 push_op(MODE|LONG_PRESS);
                 break;
+        case 's':
+                stats_print();
+                break;
+        case 'h':
+                usage_print();
+                break;
+        case 'e':
+                health_print();
+                break;
+#ifdef PROFILE
+        case 'P':
+                prof_dump();
+                break;
+#endif
         }
 }
 
+static void
+button_scan(unsigned char sample)
+{
+        if (button_debounce(sample))
+                btn.held = 0;
+        else if (btn.held < 0xff)
+                btn.held++;
+
+        if (btn.state) {
+                btn.chord |= btn.state;
+                if (btn.held == LONG_TICKS) {
+                        char op = button_op(btn.state);
+                        push_op(op | LONG_PRESS);
+                        btn.fired = 1;
+                        if (op != MODE)
+                                btn.held -= REPEAT_TICKS;
+                }
+                return;
+        }
 
+        if (btn.chord && !btn.fired)
+                push_op(button_op(btn.chord));
+        btn.chord = 0;
+        btn.fired = 0;
+
+        // all released, counters are at rest: wait for pin change
+        if (sample == 0) {
+                buttons_awake = 0;
+                button_irq(1);
+                // pressed before pin change interrupt was armed
+                if (button_read())
+                        button_wake();
+        }
+}
+
+static volatile unsigned char ticks_pending;
+
+// Called from board timer ISR. Must stay short: it only samples buttons,
+// everything else is deferred to bottom_half(), so TIMER1_COMPB_vect is
+// never delayed by I2C, UART or printf.
+// pc is where the ISR interrupted, kept for a watchdog reset: main context
+// stuck with interrupts on is caught in the act, a stall with interrupts
+// off leaves the last place seen before it.
 void
-button_scan()
+tick(const void *pc)
 {
-        uart_read();
+        wdt_pc = (uint16_t)pc;
+        wdt_pc_check = ~(uint16_t)pc;
+        ticks++;
+        if (buttons_awake)
+                button_sample = button_read();
+        if (ticks_pending < 0xff)
+                ticks_pending++;
+}
 
-        unsigned char button_mask = button_read();
-        static struct button_state mode, up, down;
-        button_decode(button_mask & MODE, &mode);
-        button_decode(button_mask & UP, &up);
-        button_decode(button_mask & DOWN, &down);
+// TCNT0 counts per tick
+#define TICK_COUNTS (256U * tick_timer0_ovf)
 
-        if (mode.long_press) {
-                push_op(MODE|LONG_PRESS);
-                mode.long_press = 0;
-        } else if (up.long_press && down.long_press) {
-                push_op(MODE|LONG_PRESS);
-                up.long_press = 0;
-                down.long_press = 0;
-        } else if (up.long_press) {
-                push_op(UP|LONG_PRESS);
-                up.long_press = 0;
-                up.pressed -= 3;
-        } else if (down.long_press) {
-                push_op(DOWN|LONG_PRESS);
-                down.long_press = 0;
-                down.pressed -= 3;
-        } else if (mode.short_press) {
-                push_op(MODE);
-                mode.short_press = 0;
-        } else if ((up.short_press && down.pressed) || (down.short_press && up.pressed)) {
-                push_op(MODE);
-                up.short_press = 0;
-                down.short_press = 0;
-                up.pressed = 0;
-                down.pressed = 0;
-        } else if (up.short_press) {
-                push_op(UP);
-                up.short_press = 0;
-        } else if (down.short_press) {
-                push_op(DOWN);
-                down.short_press = 0;
+// Current time as tick number plus TCNT0 counts into the tick.
+// Main context only: no timer ISR can be half way through.
+static void
+stamp_now(uint16_t *tick, uint16_t *sub)
+{
+        cli();
+        unsigned char t = TCNT0;
+        uint16_t s = tick_phase * 256U + t;
+        *tick = ticks;
+        // TCNT0 wrapped after cli(), TIMER0_OVF_vect has not run yet
+        if ((TIFR0 & _BV(TOV0)) && t < 128)
+                s += 256;
+        sei();
+        if (s >= TICK_COUNTS) {
+                s -= TICK_COUNTS;
+                (*tick)++;
         }
+        *sub = s;
+}
 
-        // ds3231_sync() takes less than 1ms to execute with I2C set to 400kHz
-        ds3231_sync();
+// arm set_at to fire ms milliseconds from now
+static void
+set_at_arm(unsigned char hour, unsigned char min, unsigned char sec, uint16_t ms)
+{
+        uint16_t tick, sub;
+        stamp_now(&tick, &sub);
+
+        uint32_t counts = sub + (uint32_t)ms * (F_CPU / 1000) / timer0_prescaler;
+        set_at.tick = tick + counts / TICK_COUNTS;
+        set_at.sub = counts % TICK_COUNTS;
+        set_at.hour = bin2bcd(hour);
+        set_at.min = bin2bcd(min);
+        set_at.sec = bin2bcd(sec);
+        set_at.armed = 1;
+}
+
+// Called from bottom_half(). Less than a tick before deadline it spins,
+// so RTC write starts within a few TCNT0 counts of it.
+static void
+set_at_poll()
+{
+        if (!set_at.armed)
+                return;
+
+        int32_t left;
+        do {
+                uint16_t tick, sub;
+                stamp_now(&tick, &sub);
+                left = (int32_t)(int16_t)(set_at.tick - tick) * (int32_t)TICK_COUNTS
+                        + set_at.sub - sub;
+                if (left > (int32_t)TICK_COUNTS)
+                        return;
+        } while (left > 0);
+
+        set_at.armed = 0;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                time.dirty = 1;
+                time.hour = set_at.hour;
+                time.min = set_at.min;
+                time.sec = set_at.sec;
+        }
+        // writing seconds restarts DS3231 countdown chain: next increment is 1s from now
+        if (ds3231_req.status != TWI_PENDING)
+                ds3231_write();
+        push_op(REFRESH);
+}
+
+// Runs work deferred by tick(). Main context only.
+// Returns number of ticks processed.
+unsigned char
+bottom_half()
+{
+        PROFILE_SCOPE(PROF_BOTTOM_HALF);
+        cli();
+        unsigned char n = ticks_pending;
+        ticks_pending = 0;
+        sei();
+
+        for (unsigned char i = n; i; i--) {
+                if (buttons_awake)
+                        button_scan(button_sample);
+                // ds3231_sync() only queues TWI request, transfer is done by TWI_vect
+                ds3231_sync();
+        }
+        uart_read(n);
+        set_at_poll();
+        usage_tick(n);
+        usage_poll();
+        health_poll(n);
+        log_flush();
+        return n;
+}
+
+static uint32_t idle_counts; // TCNT0 counts spent sleeping
+volatile unsigned char idle_sleeping, idle_wake;
+
+// Must be called with interrupts disabled, right after the wait condition was
+// checked. sei() takes effect after the next instruction, so sleep_cpu() is
+// entered before any ISR can change the condition and wakeup is never lost.
+// Returns with interrupts enabled, after the wakeup ISR has run.
+void
+idle()
+{
+        // TIMER0_OVF wakes us up at least once per TCNT0 period, so 8 bits is enough
+        unsigned char t = TCNT0;
+        idle_sleeping = 1;
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+        cli();
+        // wakeup ISR without IDLE_WAKE() leaves it set
+        unsigned char w = idle_sleeping ? TCNT0 : idle_wake;
+        idle_sleeping = 0;
+        sei();
+        idle_counts += (unsigned char)(w - t);
+}
+
+// sleeps until there is an op
+static char
+wait_op()
+{
+        for (;;) {
+                char op = pop_op();
+                if (op != NOP)
+                        return op;
+                cli();
+                if (ticks_pending == 0 && events_empty())
+                        idle();
+                sei();
+        }
+}
+
+static void
+stats_print()
+{
+        static uint16_t since;
+        cli();
+        uint16_t t = ticks, mismatch = rtc_mismatch;
+        uint16_t dropped = events_dropped, coalesced = events_coalesced;
+        sei();
+
+        // cpu load since previous query, in TCNT0 counts
+        uint32_t total = (uint32_t)(uint16_t)(t - since) * 256 * tick_timer0_ovf;
+        uint32_t busy = total > idle_counts ? total - idle_counts : 0;
+        printf_P(PSTR("cpu: idle %lu busy %lu (x%u cycles), load %lu%%\n"),
+               total - busy, busy, timer0_prescaler, total ? busy / (total / 100 + 1) : 0);
+        since = t;
+        idle_counts = 0;
+        printf_P(PSTR("rtc: %S, resync mismatches %u\n"),
+                 sqw_active() ? PSTR("sqw") : PSTR("polling"), mismatch);
+        printf_P(PSTR("stack: %u bytes never used\n"), stack_free());
+        printf_P(PSTR("events: dropped %u, coalesced %u, max latency %u ticks\n"),
+                 dropped, coalesced, event_latency_max);
+        event_latency_max = 0;
 }
 
 static char fade_step = 10, inner_frame_count = 8 ;
@@ -295,31 +768,252 @@ update_fade_step()
         //           = (128 / fade_step) * inner_frames
         // fade_step = (128 / frames)    * inner_frames
         // fade_step = (128  * inner_frames) / frames
-        inner_frame_count = sqrt(frames);
-        fade_step = 128 * (uint16_t)inner_frame_count / frames;
+        // inner_frames = floor(sqrt(frames)), frames is 25..625
+        unsigned char root = isqrt(frames);
+        inner_frame_count = root;
+        fade_step = 128 * (uint16_t)root / frames;
 }
 
+enum fade_mode {
+        FADE_NONE,
+        FADE_CROSS,  // PDM crossfade from old digit to new one
+        FADE_SLOT,   // digit rolls up to new value, like slot machine
+        FADE_SCROLL, // changed part of the display scrolls left
+};
+
+// Digit transition state, rendered frame by frame by animate() from display ISR.
+// Main loop must clear `active` before painting anything itself.
+static struct {
+        volatile char active;
+        char type;
+        char from[6], to[6]; // one digit per tube
+        char d;
+        unsigned char frame; // frames left in current step
+        unsigned char step;
+        unsigned char pdm_duty, pdm_state;
+} anim;
+
+enum antipoison_pattern {
+        AP_ALL,      // every tube shows the same digit
+        AP_SLOT,     // digits roll with an offset per tube
+        AP_ADAPTIVE, // only cathodes behind in usage histogram, by deficit
+};
+
+// Cathode anti-poisoning, drawn by animate() instead of time while active.
+// Main loop starts and stops it, see antipoison_update().
+static struct {
+        volatile char active;
+        char cancelled; // by an op, until current window is over
+        uint16_t frames; // per step
+        uint16_t frame;
+        unsigned char j;
+        uint8_t credit[USAGE_TUBES][10]; // AP_ADAPTIVE: steps left per cathode
+} ap;
+
 static void
-refresh() {
-        static struct time prev;
-
-        if (config.fade_mode == 1) {
-                uint8_t pdm_state = 0;
-                for (char pdm_duty = 0; pdm_duty < 128; pdm_duty += fade_step) {
-                        for (char frame = inner_frame_count; frame; frame--) {
-                                pdm_state += pdm_duty;
-                                if (pdm_state & 0x80)
-                                        paint(time.hour, time.min, time.sec, time.sec & 1);
+unpack(char *digit, char x, char y, char z)
+{
+        digit[0] = x >> 4; digit[1] = x & 0xf;
+        digit[2] = y >> 4; digit[3] = y & 0xf;
+        digit[4] = z >> 4; digit[5] = z & 0xf;
+}
+
+// what tubes show, for usage histogram; 0xf is a blank tube, not counted
+static char displayed[6];
+
+// all painting goes through here
+static void
+display(char x, char y, char z, char d)
+{
+        char digit[6];
+        unpack(digit, x, y, z);
+        for (char i = 0; i < 6; i++)
+                if (digit[i] != 0xf || !tube_0xf_keeps)
+                        displayed[i] = digit[i];
+        paint(x, y, z, d);
+}
+
+// samples displayed digits every USAGE_SAMPLE seconds
+static void
+usage_tick(unsigned char n)
+{
+        static uint16_t period, left;
+        if (left > n) {
+                left -= n;
+                return;
+        }
+        // first call only starts the period: nothing is displayed yet
+        if (period)
+                usage_sample(displayed);
+        else
+                period = USAGE_SAMPLE * (F_CPU / 256 / timer0_prescaler) / tick_timer0_ovf;
+        left = period;
+}
+
+static void
+paint_digits(const char *digit, char d)
+{
+        display(digit[0] << 4 | digit[1],
+              digit[2] << 4 | digit[3],
+              digit[4] << 4 | digit[5], d);
+}
+
+// every cathode in order of their stacking in the tube
+static const char ap_digits[] PROGMEM = {1, 0, 2, 9, 8, 3, 4, 7, 6, 5};
+
+// AP_ADAPTIVE: every tube shows cathode with most credit left, so each
+// one gets exactly its credit of steps. Returns 0 once all are paid.
+static char
+antipoison_adaptive(char *digit)
+{
+        char left = 0;
+        for (char i = 0; i < USAGE_TUBES; i++) {
+                uint8_t *credit = ap.credit[i];
+                char best = 0;
+                for (char c = 1; c < 10; c++)
+                        if (credit[c] > credit[best])
+                                best = c;
+                if (credit[best]) {
+                        credit[best]--;
+                        left = 1;
+                }
+                digit[i] = best;
+        }
+        return left;
+}
+
+static void
+antipoison_step()
+{
+        char digit[6];
+        if (config.antipoison_pattern == AP_ADAPTIVE) {
+                if (!antipoison_adaptive(digit)) {
+                        // balanced: give display back until current window is over
+                        ap.active = 0;
+                        ap.cancelled = 1;
+                        push_op(REFRESH);
+                        return;
+                }
+        } else {
+                for (char i = 0; i < 6; i++) {
+                        char k = ap.j + (config.antipoison_pattern == AP_SLOT ? i : 0);
+                        digit[i] = pgm_read_byte(&ap_digits[k < 10 ? k : k - 10]);
+                }
+                ap.j = ap.j < 9 ? ap.j + 1 : 0;
+        }
+        paint_digits(digit, 0);
+}
+
+// Called by board from display ISR once per frame, with interrupts enabled.
+// Draws next frame of running transition. Unchanged tubes are never animated:
+// every transition maps equal from/to digits to themselves.
+void
+animate()
+{
+        PROFILE_SCOPE(PROF_ANIMATE);
+        static char busy;
+        if ((!anim.active && !ap.active) || busy)
+                return;
+        busy = 1;
+
+        if (ap.active) {
+                if (--ap.frame == 0) {
+                        ap.frame = ap.frames;
+                        antipoison_step();
+                }
+                busy = 0;
+                return;
+        }
+
+        char cur[6], done = 1;
+        char step = --anim.frame == 0;
+        if (step) {
+                anim.frame = inner_frame_count;
+                anim.step++;
+        }
+
+        switch (anim.type) {
+        case FADE_CROSS: {
+                anim.pdm_state += anim.pdm_duty;
+                char *src = anim.pdm_state & 0x80 ? anim.to : anim.from;
+                anim.pdm_state &= 0x7f;
+                memcpy(cur, src, sizeof cur);
+                if (step)
+                        anim.pdm_duty += fade_step;
+                done = anim.pdm_duty >= 128;
+                break;
+        }
+        case FADE_SLOT:
+                for (char i = 0; i < 6; i++) {
+                        if (step && anim.from[i] != anim.to[i])
+                                anim.from[i] = anim.from[i] < 9 ? anim.from[i] + 1 : 0;
+                        cur[i] = anim.from[i];
+                        if (anim.from[i] != anim.to[i])
+                                done = 0;
+                }
+                break;
+        case FADE_SCROLL: {
+                char r = 0;
+                while (r < 6 && anim.from[r] == anim.to[r])
+                        r++;
+                char len = 6 - r;
+                for (char i = 0; i < 6; i++) {
+                        char j = i - r + anim.step;
+                        if (i < r)
+                                cur[i] = anim.to[i];
                         else
-                                paint(prev.hour, prev.min, prev.sec, prev.sec & 1);
-                                wait_frame_sync();
-                                pdm_state &= 0x7f;
-                        }
+                                cur[i] = j < len ? anim.from[r + j] : anim.to[r + j - len];
                 }
-                prev = time;
+                done = anim.step >= len;
+                break;
+        }
+        }
+
+        if (done) {
+                memcpy(cur, anim.to, sizeof cur);
+                anim.active = 0;
+        }
+        paint_digits(cur, anim.d);
+        busy = 0;
+}
+
+// noinline: keep it a separate symbol, so `make bench` can measure it
+static void __attribute__((noinline))
+refresh() {
+        PROFILE_SCOPE(PROF_REFRESH);
+        static char shown[6];
+        char to[6];
+        struct time now;
+
+        // INT0_vect and TWI_vect update time
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                now = time;
+
+        unpack(to, now.hour, now.min, now.sec);
+        anim.active = 0;
+
+        if (config.fade_mode == FADE_NONE || memcmp(shown, to, sizeof to) == 0) {
+                memcpy(shown, to, sizeof to);
+                display(now.hour, now.min, now.sec, now.sec & 1);
+                return;
         }
 
-        paint(time.hour, time.min, time.sec, time.sec & 1);
+        // post transition, display ISR does the rest
+        anim.type = config.fade_mode;
+        memcpy(anim.from, shown, sizeof shown);
+        memcpy(anim.to, to, sizeof to);
+        for (char i = 0; i < 6; i++)
+                if (anim.from[i] > 9)
+                        anim.from[i] = anim.to[i];
+        anim.d = now.sec & 1;
+        anim.frame = inner_frame_count;
+        anim.step = 0;
+        anim.pdm_duty = 0;
+        anim.pdm_state = 0;
+        memcpy(shown, to, sizeof to);
+        // memory barrier: anim must be complete before display ISR sees it
+        __sync_synchronize();
+        anim.active = 1;
 }
 
 static void
@@ -363,63 +1057,104 @@ time_down(struct time *time)
 static void
 config_print()
 {
-        printf("configuration:\n");
-        printf("  tube_pwm_freq:        %d\n", config.tube_pwm_freq);
-        printf("  tube_pwm_duty:        %d\n", config.tube_pwm_duty);
-        printf("  led_red_brightness:   %d\n", config.led_red_brightness);
-        printf("  led_green_brightness: %d\n", config.led_green_brightness);
-        printf("  led_blue_brightness:  %d\n", config.led_blue_brightness);
-        printf("  antipoison_start:     %d\n", config.antipoison_start);
-        printf("  antipoison_duration:  %d\n", config.antipoison_duration);
-        printf("  fade_mode:            %d\n", config.fade_mode);
-}
-
-static uint8_t
-config_crc(const struct config *cfg)
-{
-        uint8_t crc = 0, *ptr = (uint8_t *)cfg;
-        for (char i = 1; i < sizeof config; i++)
-                crc = _crc8_ccitt_update(crc, ptr[i]);
-        return crc;
+        printf_P(PSTR("configuration:\n"));
+        printf_P(PSTR("  tube_pwm_freq:        %d\n"), config.tube_pwm_freq);
+        printf_P(PSTR("  tube_pwm_duty:        %d\n"), config.tube_pwm_duty);
+        printf_P(PSTR("  led_red_brightness:   %d\n"), config.led_red_brightness);
+        printf_P(PSTR("  led_green_brightness: %d\n"), config.led_green_brightness);
+        printf_P(PSTR("  led_blue_brightness:  %d\n"), config.led_blue_brightness);
+        printf_P(PSTR("  antipoison_start:     %d\n"), config.antipoison_start);
+        printf_P(PSTR("  antipoison_duration:  %d\n"), config.antipoison_duration);
+        printf_P(PSTR("  antipoison_speed:     %d\n"), config.antipoison_speed);
+        printf_P(PSTR("  antipoison_pattern:   %d\n"), config.antipoison_pattern);
+        printf_P(PSTR("  antipoison_sweep:     %d\n"), config.antipoison_sweep);
+        printf_P(PSTR("  fade_mode:            %d\n"), config.fade_mode);
+        printf_P(PSTR("  rtc_sqw:              %d\n"), config.rtc_sqw);
+        if (tube_mux_phases > 1)
+                printf_P(PSTR("  tube_trim:            %d %d %d\n"),
+                         config.tube_trim[0], config.tube_trim[1], config.tube_trim[2]);
 }
 
 static void
 config_init()
 {
-        eeprom_busy_wait();
-
-        struct config tmp = { .crc = 0 };
-        eeprom_read_block(&tmp, (void *)13, sizeof config);
-        if (tmp.crc == config_crc(&tmp))
-                memcpy(&config, &tmp, sizeof config);
+        // defaults stay if journal is empty and there is no pre-journal config
+        journal_read(&config);
 }
 
+// returns at once, EEPROM is written in background and only if config changed
 static void
 config_write()
 {
-        config.crc = config_crc(&config);
-        eeprom_write_block(&config, (void *)13, sizeof config);
+        journal_write(&config);
 }
 
+// param flags
+#define P_FREQ_MAX 0x01 // upper bound is tube_pwm_freq_max
+#define P_MUX      0x02 // only if tube_mux_phases > 1
+
 struct param {
         unsigned char id;
         unsigned char *val;
         unsigned char flags;
         unsigned char lower_bound;
         unsigned char upper_bound;
-        const char *descr;
-} param[] = {
-        {0x01, &config.led_red_brightness,	0,	0,	10, "red led pwm"},
-        {0x02, &config.led_green_brightness,	0,	0,	10, "green led pwm"},
-        {0x03, &config.led_blue_brightness,	0,	0,	10, "blue led pwm"},
-        {0x04, &config.tube_pwm_freq,		0,	10,	90, "tube pwm"},
-        {0x05, &config.tube_pwm_duty,		0,	0,	99, "tube duty"},
-        {0x06, &config.antipoison_start,	0,	0,	24, "antipoison start"},
-        {0x07, &config.antipoison_duration,	0,	0,	24, "antipoison duration"},
-        {0x08, &config.fade_mode,		0,	0,	1,  "fade mode"},
+        PGM_P descr;
+};
+
+static const char descr_red[] PROGMEM = "red led pwm";
+static const char descr_green[] PROGMEM = "green led pwm";
+static const char descr_blue[] PROGMEM = "blue led pwm";
+static const char descr_freq[] PROGMEM = "tube pwm";
+static const char descr_duty[] PROGMEM = "tube duty";
+static const char descr_ap_start[] PROGMEM = "antipoison start";
+static const char descr_ap_duration[] PROGMEM = "antipoison duration";
+static const char descr_fade[] PROGMEM = "fade mode";
+static const char descr_sqw[] PROGMEM = "rtc sqw";
+static const char descr_ap_speed[] PROGMEM = "antipoison speed";
+static const char descr_ap_pattern[] PROGMEM = "antipoison pattern";
+static const char descr_ap_sweep[] PROGMEM = "antipoison sweep";
+static const char descr_trim1[] PROGMEM = "tube trim 1";
+static const char descr_trim2[] PROGMEM = "tube trim 2";
+static const char descr_trim3[] PROGMEM = "tube trim 3";
+
+// in flash, access it with param_load()
+static const struct param param[] PROGMEM = {
+        {0x01, &config.led_red_brightness,	0,	0,	10, descr_red},
+        {0x02, &config.led_green_brightness,	0,	0,	10, descr_green},
+        {0x03, &config.led_blue_brightness,	0,	0,	10, descr_blue},
+        {0x04, &config.tube_pwm_freq,		P_FREQ_MAX, 10,	0,  descr_freq}, // bound from board
+        {0x05, &config.tube_pwm_duty,		0,	0,	99, descr_duty},
+        {0x06, &config.antipoison_start,	0,	0,	24, descr_ap_start},
+        {0x07, &config.antipoison_duration,	0,	0,	24, descr_ap_duration},
+        {0x08, &config.fade_mode,		0,	0,	3,  descr_fade},
+        {0x09, &config.rtc_sqw,		0,	0,	1,  descr_sqw},
+        {0x0a, &config.tube_trim[0],		P_MUX,	50,	100, descr_trim1},
+        {0x0b, &config.tube_trim[1],		P_MUX,	50,	100, descr_trim2},
+        {0x0c, &config.tube_trim[2],		P_MUX,	50,	100, descr_trim3},
+        {0x0d, &config.antipoison_speed,	0,	1,	100, descr_ap_speed},
+        {0x0e, &config.antipoison_pattern,	0,	0,	2,  descr_ap_pattern},
+        {0x0f, &config.antipoison_sweep,	0,	0,	59, descr_ap_sweep},
         {0xff, NULL, 				0, 	0, 	0,  NULL},
 };
 
+// copies param[] entry to RAM, returns 0 at the end of table
+static char
+param_load(const struct param *pp, struct param *p)
+{
+        memcpy_P(p, pp, sizeof *p);
+        if (p->flags & P_FREQ_MAX)
+                p->upper_bound = tube_pwm_freq_max;
+        return p->val != NULL;
+}
+
+// params which mean nothing on this board are hidden
+static char
+param_used(const struct param *p)
+{
+        return !(p->flags & P_MUX) || tube_mux_phases > 1;
+}
+
 
 static void
 update_u8(char op, uint8_t *val, uint8_t flags, uint8_t lower_bound, uint8_t upper_bound)
@@ -440,26 +1175,36 @@ static void
 mode()
 {
         unsigned char count = 0;
-        struct param *p = param;
+        const struct param *pp = param;
+        struct param p;
+        param_load(pp, &p);
 
         do {
-                paint(p->id, 0xff, bin2bcd(*p->val), 0);
+                // values above 99 show hundreds on the middle tube pair
+                unsigned char v = *p.val, h = 0;
+                while (v > 99) {
+                        v -= 100;
+                        h++;
+                }
+                anim.active = 0;
+                display(p.id, h ? 0xf0 | h : 0xff, bin2bcd(v), 0);
 
-                char op = pop_op();
+                char op = wait_op();
                 if (op != NOP)
                         count = op == REFRESH ? count + 1 : 0;
                 switch (op) {
                 case MODE|LONG_PRESS:
                         goto out;
                 case MODE:
-                        p++;
-                        if (p->val == NULL)
-                                goto out;
+                        do {
+                                if (!param_load(++pp, &p))
+                                        goto out;
+                        } while (!param_used(&p));
                         break;
                 case UP:
                         /* fallthrough */
                 case DOWN:
-                        update_u8(op, p->val, p->flags, p->lower_bound, p->upper_bound);
+                        update_u8(op, p.val, p.flags, p.lower_bound, p.upper_bound);
                         config_apply();
                         update_fade_step();
                         break;
@@ -471,83 +1216,318 @@ out:
         push_op(REFRESH);
 }
 
-static char
-attention_requested()
+/*
+  Framed binary protocol, parsed incrementally from UART input:
+    0xa5, len, op, payload[len], crc8
+  crc8 is _crc8_ccitt_update() over len, op and payload.
+  Reply is framed the same way with op | 0x80, or CMD_ERROR with
+  request op and error code as payload.
+  Bytes outside of frames are single character commands. After a bad
+  length, crc mismatch or stalled frame the rest of it is discarded until
+  the line is idle for ~100ms or the next 0xa5, so payload bytes are
+  never taken as commands.
+ */
+#define PROTO_SYNC 0xa5
+#define PROTO_MAX 16
+#define PROTO_REPLY 0x80
+#define PROTO_IDLE 10 // ticks
+
+enum proto_cmd {
+        CMD_VERSION = 0x01,     //                 -> version string
+        CMD_GET_TIME = 0x02,    //                 -> hour, min, sec
+        CMD_SET_TIME = 0x03,    // hour, min, sec  ->
+        CMD_GET_PARAM = 0x04,   // id              -> id, val
+        CMD_SET_PARAM = 0x05,   // id, val         -> id, val
+        CMD_DUMP_CONFIG = 0x06, //                 -> (id, val) for every param
+        CMD_SET_TIME_AT = 0x07, // hour, min, sec, ms lo, ms hi -> (set ms after frame end)
+        CMD_GET_HEALTH = 0x08,  //                 -> struct health without crc
+        CMD_CLEAR_HEALTH = 0x09, //                ->
+        CMD_ERROR = 0x7f,       //                 -> op, error
+};
+
+enum proto_error {
+        E_CRC = 1,
+        E_CMD,
+        E_ARG,
+        E_LEN,
+};
+
+static struct {
+        unsigned char state, idle; // state: 0 no frame, 1..4 header/payload/crc, 5 discard
+        unsigned char len, op, n, crc;
+        unsigned char buf[PROTO_MAX];
+} rx;
+
+// buf is in flash if pgm is set
+static void
+proto_send(unsigned char op, const void *buf, unsigned char len, char pgm)
 {
-        switch (pop_op()) {
-        case NOP:
-        case REFRESH:
-                return 0;
-        default:
-                return 1;
+        const unsigned char *p = buf;
+        unsigned char crc = _crc8_ccitt_update(0, len);
+        crc = _crc8_ccitt_update(crc, op);
+
+        putchar(PROTO_SYNC);
+        putchar(len);
+        putchar(op);
+        while (len--) {
+                unsigned char c = pgm ? pgm_read_byte(p) : *p;
+                p++;
+                crc = _crc8_ccitt_update(crc, c);
+                putchar(c);
         }
+        putchar(crc);
 }
+#define proto_reply(op, buf, len) proto_send(op, buf, len, 0)
+#define proto_reply_P(op, buf, len) proto_send(op, buf, len, 1)
 
 static void
-antipoison()
+proto_error(unsigned char op, unsigned char error)
 {
-        if (config.antipoison_duration == 0)
-                return;
+        unsigned char e[2] = { op, error };
+        proto_reply(CMD_ERROR | PROTO_REPLY, e, sizeof e);
+}
+
+// loads param with given id to p, returns 0 if there is none
+static char
+param_find(unsigned char id, struct param *p)
+{
+        for (const struct param *pp = param; param_load(pp, p); pp++)
+                if (p->id == id && param_used(p))
+                        return 1;
+        return 0;
+}
 
+static void
+proto_exec(unsigned char op, const unsigned char *a, unsigned char len)
+{
+        unsigned char reply[2 * sizeof param / sizeof param[0]], n = 0;
+        struct param p;
 
-        static char disabled_today;
-        if (disabled_today == time.date)
+        switch (op) {
+        case CMD_VERSION:
+                proto_reply_P(op | PROTO_REPLY, version, sizeof version - 1);
+                return;
+        case CMD_GET_TIME:
+                ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                        reply[n++] = bcd2bin(time.hour);
+                        reply[n++] = bcd2bin(time.min);
+                        reply[n++] = bcd2bin(time.sec);
+                }
+                break;
+        case CMD_SET_TIME:
+                if (len != 3 || a[0] > 23 || a[1] > 59 || a[2] > 59)
+                        goto arg;
+                // dirty first: TWI_vect must not overwrite time with RTC data from now on
+                time.dirty = 1;
+                time.hour = bin2bcd(a[0]);
+                time.min = bin2bcd(a[1]);
+                time.sec = bin2bcd(a[2]);
+                push_op(REFRESH);
+                break;
+        case CMD_SET_TIME_AT:
+                if (len != 5 || a[0] > 23 || a[1] > 59 || a[2] > 59)
+                        goto arg;
+                set_at_arm(a[0], a[1], a[2], a[3] | a[4] << 8);
+                break;
+        case CMD_GET_PARAM:
+        case CMD_SET_PARAM:
+                if (len != (op == CMD_GET_PARAM ? 1 : 2) || !param_find(a[0], &p))
+                        goto arg;
+                if (op == CMD_SET_PARAM) {
+                        if (a[1] < p.lower_bound || a[1] > p.upper_bound)
+                                goto arg;
+                        *p.val = a[1];
+                        config_apply();
+                        update_fade_step();
+                        config_write();
+                }
+                reply[n++] = p.id;
+                reply[n++] = *p.val;
+                break;
+        case CMD_GET_HEALTH: {
+                struct health h;
+                health_read(&h);
+                proto_reply(op | PROTO_REPLY, &h, sizeof h - 1);
+                return;
+        }
+        case CMD_CLEAR_HEALTH:
+                if (len != 0)
+                        goto arg;
+                health_clear();
+                break;
+        case CMD_DUMP_CONFIG:
+                for (const struct param *pp = param; param_load(pp, &p); pp++) {
+                        if (!param_used(&p))
+                                continue;
+                        reply[n++] = p.id;
+                        reply[n++] = *p.val;
+                }
+                break;
+        default:
+                proto_error(op, E_CMD);
                 return;
-        disabled_today = -1;
+        }
+        proto_reply(op | PROTO_REPLY, reply, n);
+        return;
+arg:
+        proto_error(op, E_ARG);
+}
 
-        while (1) {
-                char hour = bcd2bin(time.hour),
-                    start = config.antipoison_start,
-                      end = config.antipoison_start + config.antipoison_duration;
+// returns 0 if c is not part of a frame
+static char
+proto_input(unsigned char c)
+{
+        rx.idle = 0;
+        switch (rx.state) {
+        case 0:
+                if (c != PROTO_SYNC)
+                        return 0;
+                rx.state = 1;
+                break;
+        case 1:
+                if (c > PROTO_MAX) {
+                        rx.state = 5;
+                        proto_error(0, E_LEN);
+                        break;
+                }
+                rx.len = c;
+                rx.crc = _crc8_ccitt_update(0, c);
+                rx.state = 2;
+                break;
+        case 2:
+                rx.op = c;
+                rx.crc = _crc8_ccitt_update(rx.crc, c);
+                rx.n = 0;
+                rx.state = rx.len ? 3 : 4;
+                break;
+        case 3:
+                rx.buf[rx.n++] = c;
+                rx.crc = _crc8_ccitt_update(rx.crc, c);
+                if (rx.n == rx.len)
+                        rx.state = 4;
+                break;
+        case 4:
+                if (c != rx.crc) {
+                        // a lost byte shifts the frame, its tail may follow
+                        rx.state = 5;
+                        proto_error(rx.op, E_CRC);
+                        break;
+                }
+                rx.state = 0;
+                proto_exec(rx.op, rx.buf, rx.len);
+                break;
+        case 5:
+                if (c == PROTO_SYNC)
+                        rx.state = 1;
+                break;
+        }
+        return 1;
+}
 
-                if (hour < start || hour >= end)
-                        return;
+// called once per tick: a frame which stalled for ~100ms is dropped, and
+// its tail discarded until the line is idle again
+static void
+proto_tick()
+{
+        if (rx.state == 0 || ++rx.idle <= PROTO_IDLE)
+                return;
+        rx.state = rx.state == 5 ? 0 : 5;
+        rx.idle = 0;
+}
 
-                if (attention_requested() ) {
-                        disabled_today = time.date;
-                        return;
-                }
+// Starts or stops anti-poisoning for current time, on every REFRESH.
+// It runs from antipoison_start for antipoison_duration hours, and for
+// the first antipoison_sweep seconds of every hour.
+static void
+antipoison_update()
+{
+        struct time now;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                now = time;
+
+        unsigned char hour = bcd2bin(now.hour);
+        char want = 0;
+        if (config.antipoison_duration && hour >= config.antipoison_start &&
+            hour < config.antipoison_start + config.antipoison_duration)
+                want = 1;
+        if (now.min == 0 && bcd2bin(now.sec) < config.antipoison_sweep)
+                want = 1;
+
+        if (!want || ap.cancelled) {
+                ap.active = 0;
+                ap.cancelled = want;
+                return;
+        }
+        if (ap.active)
+                return;
+
+        // frames per second is 10 * tube_pwm_freq / tube_mux_phases
+        uint16_t frames = (uint16_t)config.antipoison_speed * config.tube_pwm_freq
+                / (unsigned char)(10 * tube_mux_phases);
+        ap.frames = frames ? frames : 1;
+        ap.frame = 1;
+        for (unsigned char i = 0; i < USAGE_TUBES; i++)
+                usage_deficit(i, ap.credit[i]);
+        anim.active = 0;
+        // memory barrier: ap must be complete before display ISR sees it
+        __sync_synchronize();
+        ap.active = 1;
+}
 
-                static char j;
-                const char d[] = {1, 0, 2, 9, 8, 3, 4, 7, 6, 5};
-                char x = (d[j] << 4) | d[j];
-                paint(x, x, x, 0);
-                j = j < 9 ? j + 1 : 0;
-                _delay_ms(500);
-         }
+// op arrived: user wants to see the clock
+static void
+antipoison_cancel()
+{
+        if (!ap.active)
+                return;
+        ap.active = 0;
+        ap.cancelled = 1;
+        push_op(REFRESH);
 }
 
 int
 main()
 {
         config_init();
+        usage_init();
+        health_init(reset_mcusr, wdt_pc_check == (uint16_t)~wdt_pc ? wdt_pc : 0);
+        wdt_pc_check = wdt_pc; // not reported again unless tick() samples it
 	sei();
         uart_init(115200); // esp_link fails if uart != 115200
-        i2c_init();
+        twi_init(400000UL); // DS3231 supports upto 400kHz I2C
+        // DS3231 SQW is open drain, INT0_vect is enabled by ds3231_sync()
+        PORTD |= _BV(PD2);
+        EICRA |= _BV(ISC01);
         board_init();
+        prof_init();
 
-        printf("version: %s\n", VERSION);
+        printf_P(PSTR("version: %S\n"), version);
 
         config_apply();
         update_fade_step();
         config_print();
 
+        set_sleep_mode(SLEEP_MODE_IDLE);
         wdt_enable(WDTO_250MS);
 
 	for (;;) {
-                antipoison();
-
-                char op = pop_op();
+                char op = wait_op();
+                if (op != REFRESH)
+                        antipoison_cancel();
                 switch (op & 0x7f) {
                 case REFRESH:
-                        refresh();
+                        antipoison_update();
+                        if (!ap.active)
+                                refresh();
                         break;
                 case UP:
-                        time_up(&time);
+                        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                                time_up(&time);
                         refresh();
                         break;
                 case DOWN:
-                        time_down(&time);
+                        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                                time_down(&time);
                         refresh();
                         break;
                 case MODE:
@@ -1,10 +1,14 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include "avr/io.h"
 
 #include "nixie.h"
+#include "profile.h"
+#include "load.h"
 
 
 /*
@@ -47,6 +51,24 @@ button_read()
         return mask;
 }
 
+void
+button_irq(char enable)
+{
+        if (enable) {
+                PCIFR = _BV(PCIF1); // drop changes seen while scanning
+                PCICR |= _BV(PCIE1);
+        } else {
+                PCICR &= ~_BV(PCIE1);
+        }
+}
+
+ISR(PCINT1_vect)
+{
+        IDLE_WAKE();
+        PROFILE_SCOPE(PROF_PCINT);
+        button_wake();
+}
+
 static void
 led_brightness(char r, char g, char b)
 {
@@ -68,19 +90,34 @@ led_brightness(char r, char g, char b)
         else TCCR2A &= ~_BV(COM2B1);
 }
 
+const unsigned char tube_pwm_freq_max = 90;
+const unsigned char tube_mux_phases = 1;
+const unsigned char tube_0xf_keeps = 0;
+
+// OC1B raises LE at BOTTOM, shift-out must be done by then. LE-off window
+// (OCR1B..TOP) is kept at least this many timer counts, 576 cycles: the
+// longest blocking ISR (TWI_vect, ~300 cycles), COMPB prologue (~70) and
+// the shift itself (~160). Caps duty at 97% at 900Hz. `make blanking`
+// checks it, the profiler's latency max shows what's left in the field.
+#define LE_OFF_MIN 9
+
 static void
 tube_pwm_config()
 {
         // Set PWM freq & duty for tubes
-        ICR1 =  (F_CPU / 64 / (config.tube_pwm_freq * 10)) - 1;
+        uint16_t top = pwm_top(config.tube_pwm_freq);
 
         if (config.tube_pwm_duty > 0) {
-                OCR1B = (uint32_t)ICR1 * config.tube_pwm_duty / 100;
+                uint16_t compare = pwm_percent(top, config.tube_pwm_duty);
+                if (compare > top - LE_OFF_MIN)
+                        compare = top - LE_OFF_MIN;
+                pwm_set(top, compare);
                 // Enable LE (tube enable) PWM output
                 // Configure "Compare Output Mode" to non-inverting mode:
                 // Clear OC1B output pin on compare match, set OC1B output pin at BOTTOM
                 TCCR1A |= _BV(COM1B1);
         } else {
+                pwm_set(top, OCR1B);
                 TCCR1A &= ~_BV(COM1B1);
         }
 }
@@ -94,65 +131,85 @@ config_apply()
                        config.led_blue_brightness * 25);
 }
 
-ISR(TIMER0_OVF_vect)
+const unsigned int timer0_prescaler = 64;
+const unsigned char tick_timer0_ovf = 10;
+volatile unsigned char tick_phase;
+
+// non-blocking: TIMER1_COMPB_vect must be able to preempt it
+ISR(TIMER0_OVF_vect, ISR_NOBLOCK)
 {
-        static char tick;
-        if (tick++ == 9) { // 976Hz/10 ~ 97Hz, button scan roughly 100 times per sec
-                tick = 0;
-                button_scan();
+        IDLE_WAKE();
+        PROFILE_SCOPE(PROF_TIMER0_OVF);
+        if (++tick_phase == tick_timer0_ovf) { // 976Hz/10 ~ 97Hz, button scan roughly 100 times per sec
+                tick_phase = 0;
+                tick(__builtin_return_address(0));
         }
 }
 
-static char * volatile framebuf;
 // TIMER1_COMPB interrupt will be executed right after clearing OC1B (which is PB2), tubes will be off at this moment.
 ISR(TIMER1_COMPB_vect)
 {
-       if (framebuf == NULL || framebuf == (void *)1)
-                goto out;
-
-        // datasheet table 3-1 suggests to disable LE when HV5122
-        // LE is connected to PB2 and will be low if PWM is enabled, becase COMPB executed after clearing OC1B (PB2)
-        // however, turn down PB2 anyway, in case of PWM is not running
-       PORTB &= ~_BV(PB2);
-
-       // 8 bytes at 4MHz is ~ 22us
-        for (signed char i = 7; i >= 0; i--) {
-                SPDR = framebuf[i];
-                loop_until_bit_is_set(SPSR, SPIF);
+        IDLE_WAKE();
+        PROFILE_SCOPE(PROF_TIMER1_COMPB);
+        PROFILE_LATENCY();
+        // HV5122 latches hold previous frame, shift only if there is a new one
+        char *buf = frame_flip();
+        if (buf) {
+                // datasheet table 3-1 suggests to disable LE when HV5122
+                // LE is connected to PB2 and will be low if PWM is enabled, becase COMPB executed after clearing OC1B (PB2)
+                // however, turn down PB2 anyway, in case of PWM is not running
+                PORTB &= ~_BV(PB2);
+
+                // 8 bytes at 8MHz, ~160 cycles: a byte is 16 cycles on
+                // the wire, an interrupt per byte would cost ~60 more
+                for (signed char i = 7; i >= 0; i--) {
+                        SPDR = buf[i];
+                        loop_until_bit_is_set(SPSR, SPIF);
+                }
+
+                PORTB |= _BV(PB2);
         }
 
-        PORTB |= _BV(PB2);
-out:
-        framebuf = NULL;
+        // next frame of digit transition is drawn with interrupts enabled
+        sei();
+        animate();
 }
 
-void
-wait_frame_sync()
-{
-        // if there is no pending paint, make a dummy one
-        if (framebuf == NULL)
-                framebuf = (void *)1;
-        while (framebuf != NULL);
-}
+// HV5122 output for digit d of tube t, as {framebuf byte, bit mask}.
+// Tubes 0-2 are bits 0-29 of the first 32-bit word, 10 bits per tube,
+// tubes 3-5 are the same bits of the second word. Words are little endian.
+#define HV_BIT(t, d) ((t) / 3 * 32 + (t) % 3 * 10 + (d))
+#define HV(t, d) { HV_BIT(t, d) / 8, _BV(HV_BIT(t, d) % 8) }
+#define HV_TUBE(t) { HV(t, 0), HV(t, 1), HV(t, 2), HV(t, 3), HV(t, 4), \
+                     HV(t, 5), HV(t, 6), HV(t, 7), HV(t, 8), HV(t, 9) }
+static const struct {
+        uint8_t byte;
+        uint8_t mask;
+} hv_map[6][10] PROGMEM = {
+        HV_TUBE(0), HV_TUBE(1), HV_TUBE(2), HV_TUBE(3), HV_TUBE(4), HV_TUBE(5),
+};
+// dots are bits 30 and 31 of both words
+#define HV_DOTS 0xc0
 
 void
 paint(char x, char y, char z, char q)
 {
-        static uint32_t buf[2];
-        buf[0] = (uint32_t)!!q << 31 | (uint32_t)!!q << 30;
-        buf[1] = (uint32_t)!!q << 31 | (uint32_t)!!q << 30;
-        if ((x >> 4)  != 0xf) buf[0] |= 1UL << (x >> 4);
-        if ((x & 0xf) != 0xf) buf[0] |= 1UL << (10 + (x & 0xf));
-        if ((y >> 4)  != 0xf) buf[0] |= 1UL << (20 + (y >> 4));
-        if ((y & 0xf) != 0xf) buf[1] |= 1UL << (y & 0xf);
-        if ((z >> 4)  != 0xf) buf[1] |= 1UL << (10 + (z >> 4));
-        if ((z & 0xf) != 0xf) buf[1] |= 1UL << (20 + (z & 0xf));
-
-        // wait for previous framebuf write cycle to complete
-        while (framebuf != NULL);
-        // memory barrier: writes to buf[] should happen before assigment to framebuf
-        __sync_synchronize();
-        framebuf = (char *)buf;
+        PROFILE_SCOPE(PROF_PAINT);
+        char *buf = frame_begin();
+        memset(buf, 0, FRAME_SIZE);
+        if (q) {
+                buf[3] = HV_DOTS;
+                buf[7] = HV_DOTS;
+        }
+
+        const char digit[3] = { x, y, z };
+        for (char t = 0; t < 6; t++) {
+                char d = t & 1 ? digit[t >> 1] & 0xf : digit[t >> 1] >> 4;
+                if (d > 9) // 0xf is blank tube
+                        continue;
+                buf[pgm_read_byte(&hv_map[t][d].byte)] |= pgm_read_byte(&hv_map[t][d].mask);
+        }
+        frame_commit();
 }
 
 static void
@@ -176,9 +233,9 @@ tube_init()
         // PWM
         TCCR1B |= _BV(CS11)|_BV(CS10); // clk_IO/64
 
-        // Fast PWM, 16-bit, TOP=ICR1
-        // WGM bits must be configured before configuring ICR1
-        TCCR1A |= _BV(WGM11);
+        // Fast PWM, 16-bit, TOP=OCR1A (double buffered, see pwm_set())
+        // OC1A is not connected, PB1 stays a port pin
+        TCCR1A |= _BV(WGM11)|_BV(WGM10);
         TCCR1B |= _BV(WGM13)|_BV(WGM12);
 
         // Configure LE as OUTPUT
@@ -189,9 +246,10 @@ tube_init()
 
         // Configure SPI pins. Set MOSI and SCK as output.
         DDRB |= _BV(PB3)|_BV(PB5);
-        // Enable SPI, Master, set clock rate fck/4 = 4MHz, MODE=2, MSB transmitted first
+        // Enable SPI, Master, set clock rate fck/2 = 8MHz, MODE=2, MSB transmitted first
         // HV5122 supports clocks up to 8MHz
         SPCR = _BV(SPE)|_BV(MSTR)|_BV(CPOL);
+        SPSR |= _BV(SPI2X);
 
         // Clear tubes
         for (char i = 0; i < 8; i++) {
@@ -211,6 +269,9 @@ button_init()
 
         // Enable pullups
         PORTC |= _BV(PC0)|_BV(PC1)|_BV(PC2);
+
+        // Pin change wakes button scan, enabled by button_irq()
+        PCMSK1 |= _BV(PCINT8)|_BV(PCINT9)|_BV(PCINT10);
 }
 
 void
@@ -10,7 +10,12 @@ struct config {
         unsigned char led_blue_brightness;
         unsigned char antipoison_start;
         unsigned char antipoison_duration;
-        unsigned char fade_mode;
+        unsigned char fade_mode; // enum fade_mode
+        unsigned char rtc_sqw; // count time by DS3231 1Hz output on INT0
+        unsigned char tube_trim[3]; // duty of each multiplex phase, % of tube_pwm_duty
+        unsigned char antipoison_speed; // step time, in 10ms
+        unsigned char antipoison_pattern; // enum antipoison_pattern
+        unsigned char antipoison_sweep; // seconds at the start of every hour, 0 is off
 };
 
 enum op {
@@ -23,13 +28,88 @@ enum op {
 
 // provided by main
 extern struct config config;
-extern void button_scan();
-extern void paint(char x, char y, char z, char d);
-extern void wait_frame_sync();
+extern void tick(const void *pc); // called from board ~100Hz timer ISR with its return address
+extern unsigned char bottom_half(); // runs work deferred by tick(), call it from busy loops
+extern void animate(); // called from display ISR once per frame, with interrupts enabled
+extern void button_wake(); // called from board pin change ISR
+extern void pwm_set(uint16_t top, uint16_t compare); // Timer1 OCR1A/OCR1B, takes effect at next BOTTOM
+
+// provided by pwm.c
+extern uint16_t pwm_top(unsigned char freq); // Timer1 TOP for tube_pwm_freq at clk_IO/64
+extern uint16_t pwm_percent(uint16_t top, unsigned char percent); // top * percent / 100, percent 0..100
+extern unsigned char isqrt(uint16_t x); // floor(sqrt(x)), x < 255 * 255
+
+// provided by frame.c
+#define FRAME_SIZE 8
+extern char *frame_begin(); // back buffer, initialized from front
+extern void frame_commit(); // display back buffer starting from next frame
+extern char *frame_flip();  // called by display ISR at frame boundary
+
+// provided by log.c
+enum log_event {
+        LOG_I2C_ERROR,  // a: TW_STATUS
+        LOG_TWI_RESET,
+        LOG_OP_DROPPED, // a: op
+        LOG_RTC_MISMATCH, // a: local sec, b: RTC sec
+        LOG_SQW_LOST,
+        LOG_EVENTS
+};
+extern void log_event(unsigned char id, unsigned char a, unsigned char b); // any context
+extern void log_flush(); // main context
+
+// provided by journal.c, it owns EEPROM below HEALTH_EEPROM
+extern char journal_read(struct config *cfg); // newest record, 0 if none; at boot
+extern void journal_write(const struct config *cfg); // appends if changed, never blocks
+extern char journal_put_byte(uint8_t *addr, uint8_t val); // main context, 0 if EEPROM is busy
+
+// provided by usage.c
+#define USAGE_TUBES 6
+#define USAGE_SAMPLE 223 // seconds between samples, prime
+#define USAGE_EEPROM (E2END + 1 - (USAGE_TUBES * 10 + 1))
+extern void usage_init(); // at boot
+extern void usage_sample(const char *digit); // main context, every USAGE_SAMPLE seconds
+extern void usage_poll(); // main context, saves table in background
+extern void usage_deficit(unsigned char tube, uint8_t *credit); // credit[10]
+extern void usage_print();
+
+// provided by health.c
+enum reset_cause {
+        RESET_OTHER,    // no MCUSR flag: jump to 0, or bootloader cleared it
+        RESET_POWER,
+        RESET_EXTERNAL,
+        RESET_BROWNOUT,
+        RESET_WATCHDOG,
+        RESET_CAUSES
+};
+#define HEALTH_LAST 4
+struct health {
+        uint16_t resets[RESET_CAUSES]; // by enum reset_cause
+        uint16_t events[LOG_EVENTS]; // by enum log_event
+        struct {
+                uint8_t cause;
+                uint16_t pc; // byte address tick() last interrupted, RESET_WATCHDOG only
+        } last[HEALTH_LAST]; // newest first
+        uint8_t crc;
+};
+#define HEALTH_EEPROM (USAGE_EEPROM - sizeof(struct health))
+extern void health_init(uint8_t mcusr, uint16_t wdt_pc); // at boot
+extern void health_event(unsigned char id); // any context, counts enum log_event
+extern void health_poll(unsigned char ticks); // main context, saves counters in background
+extern void health_read(struct health *h); // snapshot, crc is not set
+extern void health_clear();
+extern void health_print();
 
 // provided by board
 extern unsigned char button_read(); // returns inverted mask of pressed buttons
+extern void button_irq(char enable); // pin change interrupt on button pins
 extern void config_apply();
 extern void board_init();
+extern void paint(char x, char y, char z, char d);
+extern const unsigned int timer0_prescaler; // TCNT0 clock divider
+extern const unsigned char tick_timer0_ovf; // TIMER0 overflows per tick()
+extern volatile unsigned char tick_phase; // TIMER0 overflows since last tick()
+extern const unsigned char tube_pwm_freq_max; // upper bound of config.tube_pwm_freq
+extern const unsigned char tube_mux_phases; // 1 if tubes are not multiplexed
+extern const unsigned char tube_0xf_keeps; // paint() 0xf nibble keeps previous digit, else blanks tube
 
 #endif
@@ -1,10 +1,15 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include "avr/io.h"
+#include <util/atomic.h>
 
 #include "nixie.h"
+#include "profile.h"
+#include "load.h"
 
 /*
   Buttons:
@@ -30,78 +35,137 @@ button_read()
         return mask;
 }
 
-ISR(TIMER0_OVF_vect)
+void
+button_irq(char enable)
+{
+        if (enable) {
+                PCIFR = _BV(PCIF2); // drop changes seen while scanning
+                PCICR |= _BV(PCIE2);
+        } else {
+                PCICR &= ~_BV(PCIE2);
+        }
+}
+
+ISR(PCINT2_vect)
+{
+        IDLE_WAKE();
+        PROFILE_SCOPE(PROF_PCINT);
+        button_wake();
+}
+
+// Timer1 TOP 99, 1% duty steps
+const unsigned char tube_pwm_freq_max = 250;
+const unsigned char tube_mux_phases = 3;
+const unsigned char tube_0xf_keeps = 1;
+
+const unsigned int timer0_prescaler = 1024;
+const unsigned char tick_timer0_ovf = 1;
+volatile unsigned char tick_phase; // always 0, tick() on every overflow
+
+// non-blocking: TIMER1_COMPB_vect must be able to preempt it
+ISR(TIMER0_OVF_vect, ISR_NOBLOCK)
 {
-        button_scan();
+        IDLE_WAKE();
+        PROFILE_SCOPE(PROF_TIMER0_OVF);
+        tick(__builtin_return_address(0));
 }
 
 
+/*
+  Display ISRs write whole ports: frame holds PORTC images of the three
+  phases followed by PORTB images, PORTD images are fixed per phase.
+  Bits outside tube pins are sampled once by tube_init(), nothing may
+  change them afterwards.
+ */
+#define PORTD_TUBES (_BV(PD3)|_BV(PD5)|_BV(PD6))
+static uint8_t portb_keep, portc_keep, portd_off;
+static uint8_t portd_on[3] = {
+        _BV(PD6), // [@_:_@:__]
+        _BV(PD5), // [_@:__:@_]
+        _BV(PD3), // [__:@_:_@]
+};
+static uint16_t compare[3]; // OCR1B of every phase
+static unsigned char ix; // phase lit by next TIMER1_COMPB_vect
+
+// tube must deionize before next phase lights it, ~64us
+#define BLANK_MIN 16
+
 ISR(TIMER1_OVF_vect)
 {
-        // Clear mux outputs
-        PORTC &= 0xf0;
-        PORTB &= 0xf0;
-
-        // Turn off all tubes
-        PORTD &= ~_BV(PD3);
-        PORTD &= ~_BV(PD5);
-        PORTD &= ~_BV(PD6);
+        IDLE_WAKE();
+        PROFILE_SCOPE(PROF_TIMER1_OVF);
+        // Turn off all tubes, mux is rewritten before next anode goes on
+        PORTD = portd_off;
 }
 
-static volatile char output[6] = { 0xf, 0xf, 0xf, 0xf, 0xf, 0xf };
-static volatile char frame_sync;
 ISR(TIMER1_COMPB_vect)
 {
-        static char ix;
-
-        PORTC |= output[ix];
-        PORTB |= output[ix + 3];
-
-        switch (ix) {
-        case 0:
-                PORTD |= _BV(PD6); // [@_:_@:__]
-                ix = 1;
-                break;
-        case 1:
-                PORTD |= _BV(PD5); // [_@:__:@_]
-                ix = 2;
-                break;
-        case 2:
-                PORTD |= _BV(PD3); // [__:@_:_@]
-                ix = 0;
-                frame_sync = 0;
-                break;
+        IDLE_WAKE();
+        PROFILE_SCOPE(PROF_TIMER1_COMPB);
+        PROFILE_LATENCY();
+        static const uint8_t *image;
+        unsigned char i = ix;
+
+        // take new frame only at frame boundary, so phases never mix two frames
+        if (i == 0) {
+                char *f = frame_flip();
+                if (f)
+                        image = (const uint8_t *)f;
         }
-}
 
-void
-wait_frame_sync()
-{
-        frame_sync = 1;
-        while (frame_sync);
+        // mux first, anode last
+        PORTC = image[i];
+        PORTB = image[i + 3];
+        PORTD = portd_on[i];
+
+        i = i == 2 ? 0 : i + 1;
+        ix = i;
+        // double buffered, takes effect in next phase
+        OCR1B = compare[i];
+
+        // new frame started, draw next frame of digit transition
+        if (i == 1) {
+                sei();
+                animate();
+        }
 }
 
 void
 paint(char x, char y, char z, char q __attribute__((unused)))
 {
-        const char translate[16] = { 2, 8, 9, 0, 1, 5, 4, 6, 7, 3,
-                                     0xf, 0xf, 0xf, 0xf, 0xf, 0xf};
-
-        if ((x >> 4)  != 0xf) output[0] = translate[x >> 4];
-        if ((x & 0xf) != 0xf) output[1] = translate[x & 0xf];
-        if ((y >> 4)  != 0xf) output[2] = translate[y >> 4];
-        if ((y & 0xf) != 0xf) output[3] = translate[y & 0xf];
-        if ((z >> 4)  != 0xf) output[4] = translate[z >> 4];
-        if ((z & 0xf) != 0xf) output[5] = translate[z & 0xf];
+        PROFILE_SCOPE(PROF_PAINT);
+        static const char translate[16] PROGMEM = { 2, 8, 9, 0, 1, 5, 4, 6, 7, 3,
+                                                    0xf, 0xf, 0xf, 0xf, 0xf, 0xf};
+
+        // 0xf nibble keeps digit which is already displayed
+        char *output = frame_begin();
+        if ((x >> 4)  != 0xf) output[0] = portc_keep | pgm_read_byte(&translate[x >> 4]);
+        if ((x & 0xf) != 0xf) output[1] = portc_keep | pgm_read_byte(&translate[x & 0xf]);
+        if ((y >> 4)  != 0xf) output[2] = portc_keep | pgm_read_byte(&translate[y >> 4]);
+        if ((y & 0xf) != 0xf) output[3] = portb_keep | pgm_read_byte(&translate[y & 0xf]);
+        if ((z >> 4)  != 0xf) output[4] = portb_keep | pgm_read_byte(&translate[z >> 4]);
+        if ((z & 0xf) != 0xf) output[5] = portb_keep | pgm_read_byte(&translate[z & 0xf]);
+        frame_commit();
 }
 
 void
 config_apply()
 {
         // Set PWM freq & duty for tubes
-        ICR1 =  (F_CPU / 64 / (config.tube_pwm_freq * 10)) - 1;
-        // tube is enabled _after_ OC match, thus PWM is inverted
-        OCR1B = (uint32_t)ICR1 * (100 - config.tube_pwm_duty) / 100;
+        uint16_t top = pwm_top(config.tube_pwm_freq);
+        uint16_t c[3];
+        for (unsigned char i = 0; i < 3; i++) {
+                // tube_pwm_duty * tube_trim / 100
+                unsigned char duty = pwm_percent(config.tube_pwm_duty, config.tube_trim[i]);
+                // tube is enabled _after_ OC match, thus PWM is inverted
+                c[i] = pwm_percent(top, 100 - duty);
+                if (c[i] < BLANK_MIN)
+                        c[i] = BLANK_MIN;
+        }
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                memcpy(compare, c, sizeof c);
+                pwm_set(top, compare[ix]);
+        }
 }
 
 
@@ -110,13 +174,25 @@ tube_init()
 {
         TCCR1B |= _BV(CS11)|_BV(CS10); // clk_IO/64
 
-        // Fast PWM, 16-bit, TOP=ICR1
-        // WGM bits must be configured before configuring ICR1
-        TCCR1A |= _BV(WGM11);
+        // Fast PWM, 16-bit, TOP=OCR1A (double buffered, see pwm_set())
+        // OC1A is not connected, PB1 stays a mux pin
+        TCCR1A |= _BV(WGM11)|_BV(WGM10);
         TCCR1B |= _BV(WGM13)|_BV(WGM12);
 
+        portb_keep = PORTB & 0xf0;
+        portc_keep = PORTC & 0xf0;
+        portd_off = PORTD & ~PORTD_TUBES;
+        for (unsigned char i = 0; i < 3; i++)
+                portd_on[i] |= portd_off;
+
         config_apply();
 
+        // Blank mux outputs, it is the first frame TIMER1_COMPB_vect will flip in
+        char *f = frame_begin();
+        memset(f, portc_keep | 0xf, 3);
+        memset(f + 3, portb_keep | 0xf, 3);
+        frame_commit();
+
         // Set tube enable pins as outputs
         DDRD |= _BV(PD3)|_BV(PD5)|_BV(PD6);
         // Set mux pins as outputs
@@ -140,6 +216,9 @@ button_init()
         TIMSK0 |= _BV(TOIE0);
 
         // Pullups not needed: board has them already.
+
+        // Pin change wakes button scan, enabled by button_irq()
+        PCMSK2 |= _BV(PCINT20)|_BV(PCINT23);
 }
 
 void
@@ -0,0 +1,140 @@
+#ifdef PROFILE
+#include <stdint.h>
+#include <stdio.h>
+
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "avr/io.h"
+#include "util/crc16.h"
+
+#include "profile.h"
+#include "load.h"
+
+struct prof_stat {
+        uint16_t min, max;
+        uint32_t sum;
+        uint16_t count;
+        uint16_t overruns;
+};
+
+static struct prof_stat stat[PROF_MAX];
+static struct { uint16_t min, max; } latency = { 0xffff, 0 }; // display ISR, Timer1 counts
+
+// durations above budget are counted as overruns, in 0.5us units
+#define US(x) ((x) * 2)
+static const uint16_t budget[PROF_MAX] PROGMEM = {
+        [PROF_TIMER1_COMPB] = US(30),
+        [PROF_TIMER1_OVF] = US(10),
+        [PROF_TIMER0_OVF] = US(20),
+        [PROF_USART_RX] = US(10),
+        [PROF_USART_UDRE] = US(10),
+        [PROF_TWI] = US(15),
+        [PROF_INT0] = US(15),
+        [PROF_PCINT] = US(10),
+        [PROF_BOTTOM_HALF] = US(2000),
+        [PROF_DS3231_SYNC] = US(50),
+        [PROF_REFRESH] = US(100),
+        [PROF_ANIMATE] = US(200),
+        [PROF_PAINT] = US(50),
+};
+
+static volatile uint16_t ovf;
+
+ISR(TIMER2_OVF_vect)
+{
+        IDLE_WAKE();
+        ovf++;
+}
+
+// 24-bit clock
+uint32_t
+prof_now()
+{
+        uint8_t sreg = SREG;
+        cli();
+        uint16_t hi = ovf;
+        uint8_t lo = TCNT2;
+        // overflow is pending, if we are called with interrupts disabled
+        if (bit_is_set(TIFR2, TOV2) && lo < 0x80)
+                hi++;
+        SREG = sreg;
+        return (uint32_t)hi << 8 | lo;
+}
+
+void
+prof_stop(struct prof_stamp *s)
+{
+        uint32_t d = (prof_now() - s->t) & 0xffffff;
+        uint16_t d16 = d > 0xffff ? 0xffff : d;
+        struct prof_stat *p = &stat[s->id];
+
+        uint8_t sreg = SREG;
+        cli();
+        if (p->count == 0 || d16 < p->min)
+                p->min = d16;
+        if (d16 > p->max)
+                p->max = d16;
+        p->sum += d;
+        p->count++;
+        if (d > pgm_read_word(&budget[s->id]))
+                p->overruns++;
+        SREG = sreg;
+}
+
+// TIMER1_COMPB_vect only
+void
+prof_latency()
+{
+        uint16_t t = TCNT1, c = OCR1B;
+        // entry was delayed past TOP
+        uint16_t counts = t >= c ? t - c : t + OCR1A + 1 - c;
+        if (counts < latency.min)
+                latency.min = counts;
+        if (counts > latency.max)
+                latency.max = counts;
+}
+
+static uint8_t
+put(uint8_t crc, const uint8_t *p, uint8_t n)
+{
+        while (n--) {
+                putchar(*p);
+                crc = _crc8_ccitt_update(crc, *p++);
+        }
+        return crc;
+}
+
+// Binary record: "PROF", number of entries, entries (struct prof_stat, little endian),
+// display ISR latency min and max (uint16_t), crc8. Stats are reset after dump.
+void
+prof_dump()
+{
+        uint8_t crc = put(0, (const uint8_t *)"PROF", 4);
+        uint8_t n = PROF_MAX;
+        crc = put(crc, &n, 1);
+        for (uint8_t i = 0; i < PROF_MAX; i++) {
+                struct prof_stat s;
+                cli();
+                s = stat[i];
+                stat[i] = (struct prof_stat){};
+                sei();
+                crc = put(crc, (const uint8_t *)&s, sizeof s);
+        }
+        cli();
+        typeof(latency) l = latency;
+        latency.min = 0xffff;
+        latency.max = 0;
+        sei();
+        crc = put(crc, (const uint8_t *)&l, sizeof l);
+        putchar(crc);
+}
+
+// Timer2 at clk_IO/8: 0.5us per count. ncm109 blue LED PWM shares
+// Timer2, it just runs at 7.8kHz in profile build.
+void
+prof_init()
+{
+        TCCR2B = (TCCR2B & ~(_BV(CS22)|_BV(CS21)|_BV(CS20))) | _BV(CS21);
+        TIMSK2 |= _BV(TOIE2);
+}
+#endif
@@ -0,0 +1,61 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/*
+  ISR and main loop handler profiler, enabled by `make PROFILE=1`.
+
+  PROFILE_SCOPE(id) at the top of a function stamps entry with a free
+  running 0.5us clock (Timer2 at clk_IO/8, extended to 24 bits by
+  TIMER2_OVF_vect, wraps every 8.4s) and records duration when the
+  function returns. Durations are inclusive: nested interrupts count
+  against the outer scope. min/max saturate at 0xffff (32ms), longer
+  durations still count in full in sum and as overruns.
+
+  PROFILE_LATENCY() in TIMER1_COMPB_vect records how late it started, in
+  Timer1 counts (4us) since the compare match: TCNT1 - OCR1B.
+
+  UART command 'P' dumps the stats as binary record, decode it with
+  tools/profdecode.py. Keep enum prof_id in sync with it.
+ */
+
+enum prof_id {
+        PROF_TIMER1_COMPB,
+        PROF_TIMER1_OVF,
+        PROF_TIMER0_OVF,
+        PROF_USART_RX,
+        PROF_USART_UDRE,
+        PROF_TWI,
+        PROF_INT0,
+        PROF_PCINT,
+        PROF_BOTTOM_HALF,
+        PROF_DS3231_SYNC,
+        PROF_REFRESH,
+        PROF_ANIMATE,
+        PROF_PAINT,
+        PROF_MAX
+};
+
+#ifdef PROFILE
+#include <stdint.h>
+
+struct prof_stamp {
+        unsigned char id;
+        uint32_t t;
+};
+
+void prof_init();
+uint32_t prof_now();
+void prof_stop(struct prof_stamp *s);
+void prof_dump();
+void prof_latency();
+
+#define PROFILE_SCOPE(id) \
+        struct prof_stamp prof_stamp __attribute__((cleanup(prof_stop))) = { id, prof_now() }
+#define PROFILE_LATENCY() prof_latency()
+#else
+#define PROFILE_SCOPE(id)
+#define PROFILE_LATENCY()
+#define prof_init()
+#endif
+
+#endif
@@ -0,0 +1,56 @@
+#include <stdint.h>
+
+#include <avr/pgmspace.h>
+#include "avr/io.h"
+
+#include "nixie.h"
+
+/*
+  Timer arithmetic without division or floats. It is also built for
+  the host by `make mathcheck`, which compares it with the formulas it
+  replaced, see sim/mathcheck.c.
+ */
+
+// Timer1 TOP at clk_IO/64 for tube_pwm_freq 10..250 (in 10Hz),
+// board limits it with tube_pwm_freq_max
+#define PWM_TOP(f) (F_CPU / 64 / ((f) * 10) - 1)
+#define PWM_TOP10(f) PWM_TOP(f), PWM_TOP(f + 1), PWM_TOP(f + 2), PWM_TOP(f + 3), \
+                     PWM_TOP(f + 4), PWM_TOP(f + 5), PWM_TOP(f + 6), PWM_TOP(f + 7), \
+                     PWM_TOP(f + 8), PWM_TOP(f + 9)
+static const uint16_t pwm_top_table[] PROGMEM = {
+        PWM_TOP10(10), PWM_TOP10(20), PWM_TOP10(30), PWM_TOP10(40),
+        PWM_TOP10(50), PWM_TOP10(60), PWM_TOP10(70), PWM_TOP10(80),
+        PWM_TOP10(90), PWM_TOP10(100), PWM_TOP10(110), PWM_TOP10(120),
+        PWM_TOP10(130), PWM_TOP10(140), PWM_TOP10(150), PWM_TOP10(160),
+        PWM_TOP10(170), PWM_TOP10(180), PWM_TOP10(190), PWM_TOP10(200),
+        PWM_TOP10(210), PWM_TOP10(220), PWM_TOP10(230), PWM_TOP10(240),
+        PWM_TOP(250),
+};
+
+uint16_t
+pwm_top(unsigned char freq)
+{
+        return pgm_read_word(&pwm_top_table[freq - 10]);
+}
+
+// x * 5243 >> 19 == x / 100 for x < 43690
+#define DIV100(x) ((uint32_t)(x) * 5243 >> 19)
+
+// top * percent / 100 without division: top = 100 * hundreds + rest
+uint16_t
+pwm_percent(uint16_t top, unsigned char percent)
+{
+        uint16_t hundreds = DIV100(top);
+        unsigned char rest = top - hundreds * 100;
+        return hundreds * percent + DIV100((uint16_t)(rest * percent));
+}
+
+// floor(sqrt(x)) for x < 255 * 255, a few steps for fade frame counts
+unsigned char
+isqrt(uint16_t x)
+{
+        unsigned char root = 0;
+        while ((uint16_t)(root + 1) * (root + 1) <= x)
+                root++;
+        return root;
+}
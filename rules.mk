@@ -46,14 +46,19 @@ dep = $(patsubst %.o,%.d,$(obj))
 %.lss: %.elf
 	avr-objdump -h -S $< > $@
 
+%.sym: %.elf
+	avr-nm $< > $@
+
 .PHONY: %.size
 %.size: %.elf
 	@echo
 	@avr-size -C --mcu=$(MCU) $<
+	@echo "Largest RAM objects (.data/.bss):"
+	@avr-nm --size-sort -r -S -t d $< | awk '$$3 ~ /^[dDbB]$$/ { printf "  %5d %s\n", $$2, $$4 }' | head -n 12
 
 .PHONY: clean
 clean:
-	-rm -rf $(obj) $(dep) $(foreach ext,elf hex eep lss map,$(target).$(ext))
+	-rm -rf $(obj) $(dep) $(obj:.o=.su) $(foreach ext,elf hex eep lss map sym su,$(target).$(ext)) $(target).vcd sim/bench sim/mathcheck
 
 -include $(dep)
 
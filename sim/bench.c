@@ -0,0 +1,731 @@
+/*
+  Host side cycle benchmark: runs nixie firmware under simavr and
+  measures how many cycles every probed ISR/function takes.
+
+  usage: bench [-v] [-m] [-p] [-F max] [-B] [-c cycles] [-b budget] [-f freq] [-d duty] [-w trace.vcd] firmware.elf firmware.sym
+
+    firmware.sym is `avr-nm firmware.elf` output, used to find probe entry points.
+    budget file has one "name max_cycles" pair per line, every name becomes a probe.
+    ISR may be named by avr-libc vector name, i.e. TIMER1_COMPB_vect.
+    -f/-d override config.tube_pwm_freq/tube_pwm_duty before first config_apply().
+    -v copies firmware UART output to stdout.
+    -m prints blanking margin: LE-off window (OCR1B..TOP) minus time from
+       TIMER1_COMPB_vect entry to the end of the last SPI byte (ncm109 only).
+    -p sweeps every tube_pwm_freq transition a -> b (10..tube_pwm_freq_max
+       of the board, read from firmware RAM) with SET_PARAM frames over UART
+       and checks that no TIMER1_COMPB_vect period is longer than the longer
+       of the two nominal periods. Runs until sweep is done: ~6500
+       transitions for ncm109, ~58000 for oc2cpu.
+    -F max sweeps 10..max instead, for a quicker run.
+    -w records display pins to a VCD file, checked by tools/vcdcheck.py:
+       PB0..PB5, PC0..PC3, PD3, PD5, PD6 and spi_busy. simavr does not
+       toggle SCK/MOSI, so spi_busy stands for them: high from SPDR write
+       until the last bit is on the wire.
+    -B prints measured maximum of every probe plus 25% in budget file
+       format instead of the report, see `make budgets`.
+
+  Exit status is 1 if any probe exceeds its budget, budget file is still
+  marked "# uncalibrated", blanking margin is negative or a sweep period
+  is too long.
+
+  Probe cycles are exclusive: time spent in nested interrupts and in
+  other probes called from the probe is not counted, so a probe is not
+  charged for an ISR which happened to preempt it.
+
+  Stimulus:
+    DS3231 stand-in at 0x68 on TWI bus, time starts at 12:34:56 and
+    advances with simulated cycles. Writes to registers 00h..02h reset
+    the countdown chain, as on real chip. If control register has INTCN
+    cleared, 1Hz square wave is driven on PD2 (INT0), falling edge at
+    seconds increment.
+
+    UART gets a byte every 0.5s, so USART_RX_vect has something to
+    measure. Firmware ignores keyboard for first ~10s, after that
+    'u' and 'd' are sent to exercise time_up()/time_down() + refresh().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "avr_twi.h"
+#include "avr_uart.h"
+#include "avr_spi.h"
+#include "avr_ioport.h"
+#include "sim_vcd_file.h"
+
+#define FREQ 16000000
+
+static const char *vectors[] = {
+        "RESET", "INT0_vect", "INT1_vect", "PCINT0_vect", "PCINT1_vect",
+        "PCINT2_vect", "WDT_vect", "TIMER2_COMPA_vect", "TIMER2_COMPB_vect",
+        "TIMER2_OVF_vect", "TIMER1_CAPT_vect", "TIMER1_COMPA_vect",
+        "TIMER1_COMPB_vect", "TIMER1_OVF_vect", "TIMER0_COMPA_vect",
+        "TIMER0_COMPB_vect", "TIMER0_OVF_vect", "SPI_STC_vect",
+        "USART_RX_vect", "USART_UDRE_vect", "USART_TX_vect", "ADC_vect",
+        "EE_READY_vect", "ANALOG_COMP_vect", "TWI_vect", "SPM_READY_vect",
+};
+
+struct probe {
+        char name[64];
+        char sym[64];
+        unsigned long budget;
+        unsigned long calls;
+        unsigned long min, max;
+        unsigned long long total;
+};
+
+#define MAX_PROBES 32
+static struct probe probe[MAX_PROBES];
+static int nprobes;
+static struct probe *probe_at[0x8000 / 2]; // indexed by word address
+
+static char vector_at[0x8000 / 2]; // __vector_N entry points
+
+static struct frame {
+        struct probe *p; // NULL for an interrupt without probe
+        uint16_t sp;
+        avr_flashaddr_t ret;
+        avr_cycle_count_t start;
+        avr_cycle_count_t nested; // cycles of frames above this one
+} stack[16];
+static int depth;
+
+static int verbose, calibrate, uncalibrated;
+
+static const char *
+symbol_name(const char *name)
+{
+        static char buf[64];
+        for (int i = 1; i < sizeof vectors / sizeof vectors[0]; i++)
+                if (strcmp(name, vectors[i]) == 0) {
+                        snprintf(buf, sizeof buf, "__vector_%d", i);
+                        return buf;
+                }
+        return name;
+}
+
+static struct probe *
+add_probe(const char *name, unsigned long budget)
+{
+        for (int i = 0; i < nprobes; i++)
+                if (strcmp(probe[i].name, name) == 0)
+                        return &probe[i];
+        if (nprobes == MAX_PROBES)
+                return NULL;
+
+        struct probe *p = &probe[nprobes++];
+        snprintf(p->name, sizeof p->name, "%s", name);
+        snprintf(p->sym, sizeof p->sym, "%s", symbol_name(name));
+        p->budget = budget;
+        p->min = ~0UL;
+        return p;
+}
+
+static void
+read_budget(const char *path)
+{
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+                perror(path);
+                exit(2);
+        }
+
+        char line[256], name[64];
+        unsigned long budget;
+        while (fgets(line, sizeof line, f)) {
+                if (strncmp(line, "# uncalibrated", 14) == 0)
+                        uncalibrated = 1;
+                if (line[0] == '#' || sscanf(line, "%63s %lu", name, &budget) != 2)
+                        continue;
+                add_probe(name, budget);
+        }
+        fclose(f);
+}
+
+static uint32_t config_addr, config_apply_addr, freq_max_addr;
+
+static void
+read_symbols(const char *path)
+{
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+                perror(path);
+                exit(2);
+        }
+
+        char line[256], name[128], type;
+        unsigned long addr;
+        while (fgets(line, sizeof line, f)) {
+                if (sscanf(line, "%lx %c %127s", &addr, &type, name) != 3)
+                        continue;
+                if (strcmp(name, "config") == 0)
+                        config_addr = addr & 0xffff; // strip 0x800000 data space offset
+                if (strcmp(name, "tube_pwm_freq_max") == 0 && (addr & 0x800000))
+                        freq_max_addr = addr & 0xffff; // const data is copied to RAM
+                if (strcmp(name, "config_apply") == 0)
+                        config_apply_addr = addr;
+                if (type != 'T' && type != 't')
+                        continue;
+                if (strncmp(name, "__vector_", 9) == 0 && addr < 0x8000)
+                        vector_at[addr >> 1] = 1;
+                for (int i = 0; i < nprobes; i++)
+                        if (strcmp(name, probe[i].sym) == 0 && addr < 0x8000)
+                                probe_at[addr >> 1] = &probe[i];
+        }
+        fclose(f);
+}
+
+static inline uint16_t
+sp(avr_t *avr)
+{
+        return avr->data[R_SPL] | avr->data[R_SPH] << 8;
+}
+
+/* blanking margin */
+static struct probe *compb;
+static avr_cycle_count_t compb_start;
+static int spi_bytes;
+static long shift_max;
+
+// time a byte spends on the wire
+static int
+spi_byte_cycles(avr_t *avr)
+{
+        static const int div[] = { 4, 16, 64, 128 };
+        return 8 * (div[avr->data[0x4c] & 3] >> (avr->data[0x4d] & 1)); // SPCR, SPSR
+}
+
+static void
+spi_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+        avr_t *avr = param;
+        if (++spi_bytes != 8)
+                return;
+
+        // hook fires when SPDR is written
+        long shift = avr->cycle - compb_start + spi_byte_cycles(avr);
+        if (shift > shift_max)
+                shift_max = shift;
+}
+
+static void
+margin_init(avr_t *avr)
+{
+        avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT),
+                                spi_hook, avr);
+}
+
+static int
+margin_report(avr_t *avr)
+{
+        unsigned top = avr->data[0x88] | avr->data[0x89] << 8; // OCR1A
+        unsigned ocr1b = avr->data[0x8a] | avr->data[0x8b] << 8;
+        long window = (top - ocr1b) * 64L; // Timer1 runs at clk_IO/64
+
+        printf("freq %4luHz duty %2u%%: LE off %6ld cycles, shift %4ld cycles, margin %6ld cycles%s\n",
+               FREQ / 64 / (top + 1), ocr1b * 100 / top, window, shift_max, window - shift_max,
+               window < shift_max ? "  NEGATIVE" : "");
+        return window >= shift_max;
+}
+
+/* waveform capture */
+static avr_vcd_t vcd;
+static avr_irq_t *spi_busy;
+
+static avr_cycle_count_t
+spi_idle(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+        avr_raise_irq(spi_busy, 0);
+        return 0;
+}
+
+static void
+vcd_spi_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+        avr_t *avr = param;
+        avr_raise_irq(spi_busy, 1);
+        avr_cycle_timer_register(avr, spi_byte_cycles(avr), spi_idle, NULL);
+}
+
+static void
+vcd_pin(avr_t *avr, char port, int pin)
+{
+        static char names[16][4];
+        static int n;
+        snprintf(names[n], sizeof names[n], "P%c%d", port, pin);
+        avr_vcd_add_signal(&vcd, avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port), pin), 1, names[n++]);
+}
+
+static void
+vcd_init(avr_t *avr, const char *path)
+{
+        static const char *names[1] = { "spi_busy" };
+
+        // flush every 100ms
+        avr_vcd_init(avr, path, &vcd, 100000);
+        for (int i = 0; i < 6; i++)
+                vcd_pin(avr, 'B', i);
+        for (int i = 0; i < 4; i++)
+                vcd_pin(avr, 'C', i);
+        vcd_pin(avr, 'D', 3);
+        vcd_pin(avr, 'D', 5);
+        vcd_pin(avr, 'D', 6);
+
+        spi_busy = avr_alloc_irq(&avr->irq_pool, 0, 1, names);
+        avr_vcd_add_signal(&vcd, spi_busy, 1, names[0]);
+        avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT),
+                                vcd_spi_hook, avr);
+        avr_vcd_start(&vcd);
+}
+
+/* tube_pwm_freq sweep */
+static int sweeping;
+static int sweep_prev, sweep_cur;
+static int sweep_a = 10, sweep_b = 10, sweep_back, sweep_max;
+static int sweep_transitions, sweep_bad;
+static avr_cycle_count_t sweep_last;
+static avr_cycle_count_t sweep_next = 11ULL * FREQ; // firmware ignores UART for ~10s after boot
+static long sweep_worst; // longest period relative to nominal
+
+#define SWEEP_SLACK 2000 // cycles: COMPB entry latency behind other ISRs
+
+static void uart_send(avr_t *avr, uint8_t c);
+
+static long
+max(long a, long b)
+{
+        return a > b ? a : b;
+}
+
+static long
+nominal(int f)
+{
+        return (FREQ / 64 / (f * 10)) * 64L; // (TOP + 1) * 64
+}
+
+static uint8_t
+crc8(uint8_t crc, uint8_t d)
+{
+        crc ^= d;
+        for (int i = 0; i < 8; i++)
+                crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+        return crc;
+}
+
+// SET_PARAM frame: tube_pwm_freq = f
+static void
+send_freq(avr_t *avr, int f)
+{
+        uint8_t frame[] = { 0xa5, 2, 0x05, 0x04, f, 0 };
+        for (int i = 1; i < 5; i++)
+                frame[5] = crc8(frame[5], frame[i]);
+        for (int i = 0; i < sizeof frame; i++)
+                uart_send(avr, frame[i]);
+        sweep_prev = sweep_cur;
+        sweep_cur = f;
+        sweep_transitions++;
+        // frame is applied within a tick (<= 16.4ms), then 3 periods at most
+        sweep_next = avr->cycle + FREQ / 50 + 3 * max(nominal(sweep_prev), nominal(f));
+}
+
+static void
+sweep_period(avr_t *avr)
+{
+        long gap = avr->cycle - sweep_last;
+        long nom = max(nominal(sweep_prev), nominal(sweep_cur));
+        if (sweep_last && sweep_transitions) {
+                sweep_worst = max(sweep_worst, gap - nom);
+                if (gap > nom + SWEEP_SLACK && sweep_bad++ < 10)
+                        printf("sweep: %dHz -> %dHz: period %ld cycles, nominal %ld\n",
+                               sweep_prev * 10, sweep_cur * 10, gap, nom);
+        }
+        sweep_last = avr->cycle;
+}
+
+// Visits a -> b -> a for every pair a < b, so every ordered pair is a transition.
+// Returns 0 when done.
+static int
+sweep(avr_t *avr)
+{
+        if (avr->cycle < sweep_next)
+                return 1;
+
+        if (!sweep_transitions) {
+                // offset follows struct config in nixie.h
+                sweep_cur = config_addr ? avr->data[config_addr + 1] : 15;
+                if (!sweep_max)
+                        sweep_max = freq_max_addr ? avr->data[freq_max_addr] : 90;
+                send_freq(avr, sweep_a);
+        } else if (sweep_back) {
+                sweep_back = 0;
+                send_freq(avr, sweep_a);
+        } else if (sweep_b == sweep_max) {
+                if (++sweep_a == sweep_max)
+                        return 0;
+                sweep_b = sweep_a;
+                send_freq(avr, sweep_a);
+        } else {
+                sweep_back = 1;
+                send_freq(avr, ++sweep_b);
+        }
+        return 1;
+}
+
+static void
+trace(avr_t *avr)
+{
+        uint16_t s = sp(avr);
+
+        while (depth > 0 && avr->pc == stack[depth - 1].ret && s == stack[depth - 1].sp + 2) {
+                struct frame *f = &stack[--depth];
+                avr_cycle_count_t all = avr->cycle - f->start;
+                if (depth > 0)
+                        stack[depth - 1].nested += all;
+                if (f->p == NULL)
+                        continue;
+                unsigned long c = all - f->nested;
+                f->p->calls++;
+                f->p->total += c;
+                if (c < f->p->min) f->p->min = c;
+                if (c > f->p->max) f->p->max = c;
+        }
+
+        if (depth == sizeof stack / sizeof stack[0])
+                return;
+
+        // Interrupt entry: CPU is in the vector table (or already in
+        // __vector_N). Every interrupt gets a frame, so its cycles are
+        // taken out of whatever probe it preempted.
+        int irq = (avr->pc >= 4 && avr->pc < 26 * 4 && avr->pc % 4 == 0) || vector_at[avr->pc >> 1];
+        if (irq && !(depth > 0 && stack[depth - 1].p == NULL && stack[depth - 1].sp == s)) {
+                stack[depth++] = (struct frame){
+                        .sp = s,
+                        .ret = (avr->data[s + 1] << 8 | avr->data[s + 2]) << 1,
+                        .start = avr->cycle,
+                };
+                if (depth == sizeof stack / sizeof stack[0])
+                        return;
+        }
+
+        struct probe *p = probe_at[avr->pc >> 1];
+        if (p == NULL)
+                return;
+
+        if (p == compb) {
+                compb_start = avr->cycle;
+                spi_bytes = 0;
+                if (sweeping)
+                        sweep_period(avr);
+        }
+
+        // return address is pushed high byte first, so it sits at SP+1 (hi), SP+2 (lo)
+        stack[depth++] = (struct frame){
+                .p = p,
+                .sp = s,
+                .ret = (avr->data[s + 1] << 8 | avr->data[s + 2]) << 1,
+                .start = avr->cycle,
+        };
+}
+
+static int patch_freq = -1, patch_duty = -1;
+
+static void
+patch_config(avr_t *avr)
+{
+        static int done;
+        if (done || config_addr == 0 || avr->pc != config_apply_addr)
+                return;
+        done = 1;
+
+        // offsets follow struct config in nixie.h
+        if (patch_freq >= 0)
+                avr->data[config_addr + 1] = patch_freq;
+        if (patch_duty >= 0)
+                avr->data[config_addr + 2] = patch_duty;
+        // rtc_sqw: stand-in DS3231 SQW is wired to INT0, so INT0_vect is covered
+        avr->data[config_addr + 9] = 1;
+}
+
+/* DS3231 stand-in */
+static struct ds3231 {
+        avr_irq_t *irq;
+        uint8_t selected;
+        uint8_t index;  // byte index since START, 0 is register pointer
+        uint8_t ptr;
+        uint8_t reg[0x13];
+        unsigned long base; // seconds of day at epoch cycle
+        avr_cycle_count_t epoch;
+} rtc;
+
+static uint8_t bcd(unsigned v) { return (v / 10) << 4 | v % 10; }
+static unsigned bin(uint8_t v) { return (v >> 4) * 10 + (v & 0xf); }
+
+static void
+rtc_update(avr_t *avr)
+{
+        unsigned long s = rtc.base + (avr->cycle - rtc.epoch) / FREQ;
+        rtc.reg[0] = bcd(s % 60);
+        rtc.reg[1] = bcd(s / 60 % 60);
+        rtc.reg[2] = bcd(s / 3600 % 24);
+}
+
+static void
+rtc_write(avr_t *avr, uint8_t r, uint8_t v)
+{
+        rtc_update(avr);
+        rtc.reg[r] = v;
+        if (r <= 2) {
+                rtc.base = bin(rtc.reg[2] & 0x3f) * 3600 + bin(rtc.reg[1]) * 60 + bin(rtc.reg[0]);
+                rtc.epoch = avr->cycle;
+        }
+}
+
+// SQW is open drain with pull-up: high when disabled
+static void
+rtc_sqw(avr_t *avr)
+{
+        static int level = -1;
+        int l = (rtc.reg[0x0e] & 0x04) || (avr->cycle - rtc.epoch) % FREQ >= FREQ / 2;
+        if (l == level)
+                return;
+        level = l;
+        avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 2), l);
+}
+
+static void
+rtc_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+        avr_t *avr = param;
+        avr_twi_msg_irq_t v = { .u.v = value };
+
+        if (v.u.twi.msg & TWI_COND_STOP)
+                rtc.selected = 0;
+
+        if (v.u.twi.msg & TWI_COND_START) {
+                rtc.selected = 0;
+                rtc.index = 0;
+                if ((v.u.twi.addr >> 1) == 0x68) {
+                        rtc.selected = v.u.twi.addr;
+                        avr_raise_irq(rtc.irq + TWI_IRQ_INPUT,
+                                      avr_twi_irq_msg(TWI_COND_ACK, rtc.selected, 1));
+                }
+        }
+
+        if (!rtc.selected)
+                return;
+
+        if (v.u.twi.msg & TWI_COND_WRITE) {
+                avr_raise_irq(rtc.irq + TWI_IRQ_INPUT,
+                              avr_twi_irq_msg(TWI_COND_ACK, rtc.selected, 1));
+                if (rtc.index++ == 0)
+                        rtc.ptr = v.u.twi.data;
+                else
+                        rtc_write(avr, rtc.ptr++, v.u.twi.data);
+                rtc.ptr %= sizeof rtc.reg;
+        }
+
+        if (v.u.twi.msg & TWI_COND_READ) {
+                rtc_update(avr);
+                uint8_t data = rtc.reg[rtc.ptr++];
+                rtc.ptr %= sizeof rtc.reg;
+                avr_raise_irq(rtc.irq + TWI_IRQ_INPUT,
+                              avr_twi_irq_msg(TWI_COND_READ, rtc.selected, data));
+        }
+}
+
+static void
+rtc_init(avr_t *avr)
+{
+        static const char *names[2] = { "8>ds3231.in", "8<ds3231.out" };
+        rtc.irq = avr_alloc_irq(&avr->irq_pool, 0, 2, names);
+        avr_irq_register_notify(rtc.irq + TWI_IRQ_OUTPUT, rtc_hook, avr);
+        avr_connect_irq(rtc.irq + TWI_IRQ_INPUT,
+                        avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT));
+        avr_connect_irq(avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_OUTPUT),
+                        rtc.irq + TWI_IRQ_OUTPUT);
+
+        rtc.base = 12 * 3600 + 34 * 60 + 56;
+        rtc.reg[3] = 1; // day
+        rtc.reg[4] = 1; // date
+        rtc.reg[5] = 1; // month
+        rtc.reg[6] = 0x24; // year
+        rtc.reg[0x0e] = 0x1c; // control: INTCN, SQW off
+}
+
+/* UART */
+static void
+uart_out_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+        if (verbose)
+                putchar(value);
+}
+
+static void
+uart_init(avr_t *avr)
+{
+        uint32_t flags = 0;
+        avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+        flags &= ~AVR_UART_FLAG_STDIO;
+        avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+        avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT),
+                                uart_out_hook, NULL);
+}
+
+static void
+uart_send(avr_t *avr, uint8_t c)
+{
+        avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT), c);
+}
+
+static void
+stimulus(avr_t *avr)
+{
+        static avr_cycle_count_t next = FREQ / 2;
+        if (avr->cycle < next)
+                return;
+
+        unsigned half_sec = next / (FREQ / 2);
+        next += FREQ / 2;
+
+        switch (half_sec) {
+        case 21: uart_send(avr, 'u'); break;
+        case 22: uart_send(avr, 'd'); break;
+        default: uart_send(avr, '.'); break;
+        }
+}
+
+static void
+report(const char *elf, avr_t *avr)
+{
+        int over = 0;
+
+        printf("%s: %llu cycles\n", elf, (unsigned long long)avr->cycle);
+        printf("  %-22s %8s %8s %8s %8s %8s\n", "probe", "calls", "min", "avg", "max", "budget");
+        for (int i = 0; i < nprobes; i++) {
+                struct probe *p = &probe[i];
+                if (p->calls == 0) {
+                        printf("  %-22s %8s\n", p->name, "-");
+                        continue;
+                }
+                int bad = p->budget && p->max > p->budget;
+                over |= bad;
+                printf("  %-22s %8lu %8lu %8llu %8lu %8lu%s\n", p->name, p->calls,
+                       p->min, p->total / p->calls, p->max, p->budget,
+                       bad ? "  OVER BUDGET" : "");
+        }
+        if (uncalibrated)
+                printf("%s: budgets are hand estimates, not a gate: run `make budgets` and commit the result\n",
+                       elf);
+        if (over || uncalibrated)
+                exit(1);
+}
+
+// budget file: measured maximum + 25%, rounded up to 10; probes which never ran keep theirs
+static void
+budgets(const char *elf)
+{
+        printf("# probe                 max cycles\n"
+               "#\n"
+               "# Ceilings for `make bench`, bench fails if any probe goes above.\n"
+               "# Probes are exclusive, see sim/bench.c. Written by `make budgets`\n"
+               "# from a run of %s: maximum plus 25%%.\n", elf);
+        for (int i = 0; i < nprobes; i++) {
+                struct probe *p = &probe[i];
+                unsigned long b = p->calls ? (p->max * 5 / 4 + 9) / 10 * 10 : p->budget;
+                printf("%-23s %lu\n", p->name, b);
+        }
+}
+
+static void
+usage()
+{
+        fprintf(stderr, "usage: bench [-v] [-m] [-p] [-F max] [-B] [-c cycles] [-b budget] [-f freq] [-d duty] [-w trace.vcd] firmware.elf firmware.sym\n");
+        exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+        unsigned long long cycles = 12ULL * FREQ;
+        const char *budget = NULL, *wave = NULL;
+        int opt, margin = 0;
+
+        while ((opt = getopt(argc, argv, "vmpBF:c:b:f:d:w:")) != -1) {
+                switch (opt) {
+                case 'v': verbose = 1; break;
+                case 'm': margin = 1; break;
+                case 'p': sweeping = 1; break;
+                case 'B': calibrate = 1; break;
+                case 'F': sweep_max = atoi(optarg); break;
+                case 'c': cycles = strtoull(optarg, NULL, 0); break;
+                case 'b': budget = optarg; break;
+                case 'f': patch_freq = atoi(optarg); break;
+                case 'd': patch_duty = atoi(optarg); break;
+                case 'w': wave = optarg; break;
+                default: usage();
+                }
+        }
+        if (argc - optind != 2)
+                usage();
+
+        if (budget)
+                read_budget(budget);
+        if (margin || sweeping)
+                compb = add_probe("TIMER1_COMPB_vect", 0);
+        read_symbols(argv[optind + 1]);
+
+        elf_firmware_t f = {};
+        if (elf_read_firmware(argv[optind], &f) != 0) {
+                fprintf(stderr, "%s: can't load firmware\n", argv[optind]);
+                exit(2);
+        }
+        strcpy(f.mmcu, "atmega328p");
+        f.frequency = FREQ;
+
+        avr_t *avr = avr_make_mcu_by_name(f.mmcu);
+        avr_init(avr);
+        avr_load_firmware(avr, &f);
+        avr->log = verbose ? LOG_WARNING : LOG_NONE;
+
+        rtc_init(avr);
+        uart_init(avr);
+        if (margin)
+                margin_init(avr);
+        if (wave)
+                vcd_init(avr, wave);
+
+        while (sweeping || avr->cycle < cycles) {
+                int state = avr_run(avr);
+                if (state == cpu_Done || state == cpu_Crashed) {
+                        fprintf(stderr, "%s: cpu stopped at pc=0x%04x\n", argv[optind], avr->pc);
+                        exit(2);
+                }
+                patch_config(avr);
+                if (!sweeping)
+                        stimulus(avr);
+                else if (!sweep(avr))
+                        break;
+                rtc_sqw(avr);
+                trace(avr);
+        }
+
+        if (wave)
+                avr_vcd_stop(&vcd);
+        if (margin)
+                return margin_report(avr) ? 0 : 1;
+        if (sweeping) {
+                printf("%s: %d transitions, longest period %+ld cycles vs nominal, %d too long\n",
+                       argv[optind], sweep_transitions, sweep_worst, sweep_bad);
+                return sweep_bad ? 1 : 0;
+        }
+        if (calibrate)
+                budgets(argv[optind]);
+        else
+                report(argv[optind], avr);
+        return 0;
+}
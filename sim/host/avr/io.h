@@ -0,0 +1,2 @@
+/* host stand-in for avr-libc, used by sim/mathcheck.c: nixie.h needs _BV() */
+#define _BV(bit) (1 << (bit))
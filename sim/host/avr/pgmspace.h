@@ -0,0 +1,3 @@
+/* host stand-in for avr-libc flash access, used by sim/mathcheck.c */
+#define PROGMEM
+#define pgm_read_word(p) (*(const uint16_t *)(p))
@@ -0,0 +1,64 @@
+/*
+  Host check of the division-free timer arithmetic in pwm.c and
+  usart/uart.h: compares it with the float and 32-bit division formulas
+  it replaced, over every input the firmware can pass.
+
+  usage: mathcheck
+
+  Exit status is 1 on any mismatch.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "avr/io.h"
+#include "nixie.h"
+#include "usart/uart.h"
+
+static int bad;
+
+static void
+check(const char *what, long arg1, long arg2, long got, long want)
+{
+        if (got == want)
+                return;
+        if (bad++ < 10)
+                printf("%s(%ld, %ld): %ld, expected %ld\n", what, arg1, arg2, got, want);
+}
+
+static unsigned int ubrr;
+
+void
+uart_init_ubrr(unsigned int ubrr0)
+{
+        ubrr = ubrr0;
+}
+
+int
+main()
+{
+        // old config_apply(): ICR1 = (F_CPU / 64 / (config.tube_pwm_freq * 10)) - 1
+        for (unsigned char f = 10; f <= 250; f++)
+                check("pwm_top", f, 0, pwm_top(f), F_CPU / 64 / (f * 10) - 1);
+
+        // old: (uint32_t)ICR1 * duty / 100; percent is duty, 100 - duty, or
+        // duty * tube_trim / 100, top is up to PWM_TOP(10)
+        for (uint16_t top = 0; top <= pwm_top(10); top++)
+                for (unsigned char p = 0; p <= 100; p++)
+                        check("pwm_percent", top, p, pwm_percent(top, p), (uint32_t)top * p / 100);
+
+        // old update_fade_step(): inner_frame_count = sqrt(frames)
+        for (uint16_t x = 0; x < 255 * 255; x++)
+                check("isqrt", x, 0, isqrt(x), (unsigned char)sqrt(x));
+
+        // old: uart_init_ubrr(fabs(F_CPU/(16 * (double)baud) - 1) + 0.5)
+        for (unsigned long baud = 2400; baud <= 1000000; baud++) {
+                uart_init(baud);
+                check("uart_init", baud, 0, ubrr,
+                      (unsigned int)(fabs(F_CPU / (16 * (double)baud) - 1) + 0.5));
+        }
+
+        printf("mathcheck: %d mismatches\n", bad);
+        return bad ? 1 : 0;
+}
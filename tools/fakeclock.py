@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+"""Pseudo terminal stand-in for the clock firmware.
+
+usage: fakeclock.py [-l LATENCY_MS] [-b ncm109|oc2cpu] [LINK]
+
+Creates a pty which speaks the framed UART protocol (see proto_exec() in
+main.c), so tools/nixiectl.py can be tested without a clock or esp-link.
+LINK, if given, is a symlink created to the pty slave. Params and their
+bounds follow param[] in main.c for the given board (default ncm109):
+tube_pwm_freq goes up to tube_pwm_freq_max, tube_trim is only on oc2cpu.
+
+The fake clock starts at a random sub-second phase. On CMD_SET_TIME_AT it
+sets its time after the requested delay (plus LATENCY_MS, emulating link
+and firmware delay) and prints how far its seconds flip is from the host
+clock second boundary. Single character commands are printed as is.
+The health record starts as one power-on reset, CMD_CLEAR_HEALTH zeroes
+it.
+"""
+
+import argparse
+import os
+import random
+import select
+import struct
+import sys
+import time
+import tty
+
+from nixiectl import (SYNC, REPLY, CMD_VERSION, CMD_GET_TIME, CMD_SET_TIME,
+                      CMD_GET_PARAM, CMD_SET_PARAM, CMD_DUMP_CONFIG,
+                      CMD_SET_TIME_AT, CMD_GET_HEALTH, CMD_CLEAR_HEALTH, CMD_ERROR,
+                      PARAMS, RESET_CAUSES, EVENTS, HEALTH_LAST, crc8_ccitt, frame)
+
+E_CRC, E_CMD, E_ARG, E_LEN = 1, 2, 3, 4
+PROTO_MAX = 16
+
+params = {0x01: 0, 0x02: 0, 0x03: 0, 0x04: 15, 0x05: 70, 0x06: 2, 0x07: 2, 0x08: 0, 0x09: 0,
+          0x0a: 100, 0x0b: 100, 0x0c: 100, 0x0d: 50, 0x0e: 0, 0x0f: 0}
+bounds = {0x04: (10, 90), 0x05: (0, 99), 0x06: (0, 24), 0x07: (0, 24), 0x08: (0, 3), 0x09: (0, 1),
+          0x0a: (50, 100), 0x0b: (50, 100), 0x0c: (50, 100), 0x0d: (1, 100), 0x0e: (0, 2), 0x0f: (0, 59)}
+
+# struct health in nixie.h: resets, events, last (cause, pc), crc
+HEALTH = struct.Struct("<%dH%dH%sB" % (len(RESET_CAUSES), len(EVENTS), "BH" * HEALTH_LAST))
+RESET_POWER = 1
+
+
+class Health:
+    def __init__(self):
+        self.resets = [0] * len(RESET_CAUSES)
+        self.events = [0] * len(EVENTS)
+        self.last = [(0, 0)] * HEALTH_LAST
+        self.resets[RESET_POWER] = 1
+        self.last[0] = (RESET_POWER, 0)
+
+    def clear(self):
+        self.resets = [0] * len(RESET_CAUSES)
+        self.events = [0] * len(EVENTS)
+        self.last = [(0, 0)] * HEALTH_LAST
+
+    def record(self):
+        """33 bytes as in EEPROM, crc8 over the rest like health_crc()"""
+        r = HEALTH.pack(*self.resets, *self.events, *[x for l in self.last for x in l], 0)
+        return r[:-1] + bytes([crc8_ccitt(0, r[:-1])])
+
+
+health = Health()
+
+# tube_pwm_freq_max, multiplexed display (P_MUX params, tube_trim)
+BOARDS = {"ncm109": (90, False), "oc2cpu": (250, True)}
+MUX_PARAMS = (0x0a, 0x0b, 0x0c)
+
+
+class Clock:
+    def __init__(self):
+        # seconds of day = host time + offset, random phase
+        self.offset = random.uniform(0, 1)
+        self.pending = None  # (deadline, seconds of day)
+
+    def now(self):
+        return (time.time() + self.offset) % 86400
+
+    def set(self, sec):
+        self.offset = sec - time.time()
+
+    def hms(self):
+        s = int(self.now())
+        return bytes([s // 3600, s // 60 % 60, s % 60])
+
+    def poll(self):
+        if self.pending and time.time() >= self.pending[0]:
+            t = time.time()
+            self.set(self.pending[1])
+            self.pending = None
+            err = (t - round(t)) * 1000
+            print("time set, seconds flip %+.1f ms from host clock" % err)
+
+    def timeout(self):
+        return max(0, self.pending[0] - time.time()) if self.pending else None
+
+
+def exec_frame(clock, op, a, latency):
+    if op == CMD_VERSION:
+        return b"fakeclock"
+    if op == CMD_GET_TIME:
+        return clock.hms()
+    if op == CMD_SET_TIME and len(a) == 3 and a[0] < 24 and a[1] < 60 and a[2] < 60:
+        clock.set(a[0] * 3600 + a[1] * 60 + a[2])
+        return b""
+    if op == CMD_SET_TIME_AT and len(a) == 5 and a[0] < 24 and a[1] < 60 and a[2] < 60:
+        ms = a[3] | a[4] << 8
+        clock.pending = (time.time() + ms / 1000 + latency, a[0] * 3600 + a[1] * 60 + a[2])
+        return b""
+    if op == CMD_GET_PARAM and len(a) == 1 and a[0] in params:
+        return bytes([a[0], params[a[0]]])
+    if op == CMD_SET_PARAM and len(a) == 2 and a[0] in params:
+        lo, hi = bounds.get(a[0], (0, 10))
+        if lo <= a[1] <= hi:
+            params[a[0]] = a[1]
+            return bytes([a[0], a[1]])
+    if op == CMD_DUMP_CONFIG:
+        return bytes(b for k in sorted(params) for b in (k, params[k]))
+    if op == CMD_GET_HEALTH:
+        return health.record()[:-1]  # reply has no crc
+    if op == CMD_CLEAR_HEALTH and not a:
+        health.clear()
+        return b""
+    if op in (CMD_VERSION, CMD_GET_TIME, CMD_SET_TIME, CMD_SET_TIME_AT,
+              CMD_GET_PARAM, CMD_SET_PARAM, CMD_DUMP_CONFIG, CMD_CLEAR_HEALTH):
+        return E_ARG
+    return E_CMD
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("-l", "--latency", type=float, default=0.0)
+    ap.add_argument("-b", "--board", choices=sorted(BOARDS), default="ncm109")
+    ap.add_argument("link", nargs="?")
+    opt = ap.parse_args()
+
+    freq_max, mux = BOARDS[opt.board]
+    bounds[0x04] = (10, freq_max)
+    for n in MUX_PARAMS if not mux else ():
+        del params[n], bounds[n]
+
+    master, slave = os.openpty()
+    tty.setraw(slave)
+    name = os.ttyname(slave)
+    if opt.link:
+        if os.path.islink(opt.link):
+            os.unlink(opt.link)
+        os.symlink(name, opt.link)
+    print("fake clock on %s" % (opt.link or name))
+    sys.stdout.flush()
+
+    clock = Clock()
+    buf = b""
+    while True:
+        r, _, _ = select.select([master], [], [], clock.timeout())
+        clock.poll()
+        if not r:
+            continue
+        buf += os.read(master, 256)
+        while buf:
+            if buf[0] != SYNC:
+                print("command %r" % chr(buf[0]))
+                buf = buf[1:]
+                continue
+            if len(buf) < 2:
+                break
+            n = buf[1]
+            if n > PROTO_MAX:
+                os.write(master, frame(CMD_ERROR | REPLY, bytes([0, E_LEN])))
+                buf = buf[2:]
+                continue
+            if len(buf) < n + 4:
+                break
+            body, crc, buf = buf[1:n + 3], buf[n + 3], buf[n + 4:]
+            op = body[1]
+            if crc8_ccitt(0, body) != crc:
+                reply = E_CRC
+            else:
+                reply = exec_frame(clock, op, body[2:], opt.latency / 1000)
+            if isinstance(reply, int):
+                os.write(master, frame(CMD_ERROR | REPLY, bytes([op, reply])))
+            else:
+                os.write(master, frame(op | REPLY, reply))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+"""Talk to nixie clock over framed binary UART protocol.
+
+usage: nixiectl.py PORT COMMAND [ARGS]
+
+PORT is a serial device (/dev/ttyUSB0) or host:port of esp-link.
+
+commands:
+    version                 firmware version
+    time                    get time
+    settime [HH:MM:SS]      set time, local time by default
+    sync [LATENCY_MS]       set local time at next second boundary, so that
+                            seconds flip in phase with host clock; LATENCY_MS
+                            is the link delay to compensate (esp-link ~5ms)
+    get ID                  get param, ID as listed by `config`
+    set ID VALUE            set param
+    config                  dump all params
+    health [clear]          reset causes and event counters kept in EEPROM
+"""
+
+import os
+import socket
+import struct
+import stat
+import sys
+import termios
+import time
+
+SYNC = 0xA5
+REPLY = 0x80
+
+CMD_VERSION = 0x01
+CMD_GET_TIME = 0x02
+CMD_SET_TIME = 0x03
+CMD_GET_PARAM = 0x04
+CMD_SET_PARAM = 0x05
+CMD_DUMP_CONFIG = 0x06
+CMD_SET_TIME_AT = 0x07
+CMD_GET_HEALTH = 0x08
+CMD_CLEAR_HEALTH = 0x09
+CMD_ERROR = 0x7F
+
+ERRORS = {1: "crc mismatch", 2: "unknown command", 3: "bad argument", 4: "frame too long"}
+
+# param ids, see param[] in main.c
+PARAMS = {
+    0x01: "red led pwm",
+    0x02: "green led pwm",
+    0x03: "blue led pwm",
+    0x04: "tube pwm",
+    0x05: "tube duty",
+    0x06: "antipoison start",
+    0x07: "antipoison duration",
+    0x08: "fade mode",
+    0x09: "rtc sqw",
+    0x0a: "tube trim 1",
+    0x0b: "tube trim 2",
+    0x0c: "tube trim 3",
+    0x0d: "antipoison speed",
+    0x0e: "antipoison pattern",
+    0x0f: "antipoison sweep",
+}
+
+
+def crc8_ccitt(crc, data):
+    # same as avr-libc _crc8_ccitt_update()
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+def frame(op, payload=b""):
+    body = bytes([len(payload), op]) + bytes(payload)
+    return bytes([SYNC]) + body + bytes([crc8_ccitt(0, body)])
+
+
+class Port:
+    def __init__(self, path):
+        if ":" in path and not os.path.exists(path):
+            host, port = path.rsplit(":", 1)
+            self.sock = socket.create_connection((host, int(port)), timeout=2)
+            self.fd = None
+        else:
+            self.sock = None
+            self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+            if stat.S_ISCHR(os.fstat(self.fd).st_mode):
+                attr = termios.tcgetattr(self.fd)
+                attr[0] = attr[1] = attr[3] = 0
+                attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+                attr[4] = attr[5] = termios.B115200
+                attr[6][termios.VMIN] = 0
+                attr[6][termios.VTIME] = 1
+                termios.tcsetattr(self.fd, termios.TCSANOW, attr)
+        self.rx = b""
+
+    def write(self, data):
+        if self.sock:
+            self.sock.sendall(data)
+        else:
+            os.write(self.fd, data)
+
+    def read(self):
+        try:
+            if self.sock:
+                return self.sock.recv(256)
+            return os.read(self.fd, 256)
+        except (socket.timeout, BlockingIOError):
+            return b""
+
+    def request(self, op, payload=b"", timeout=2.0):
+        """send request, return reply payload; text output of firmware is skipped"""
+        self.write(frame(op, payload))
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            self.rx += self.read()
+            while True:
+                i = self.rx.find(bytes([SYNC]))
+                if i < 0:
+                    self.rx = b""
+                    break
+                self.rx = self.rx[i:]
+                if len(self.rx) < 4 or len(self.rx) < 4 + self.rx[1]:
+                    break
+                n, rop = self.rx[1], self.rx[2]
+                body, crc = self.rx[1:3 + n], self.rx[3 + n]
+                if crc8_ccitt(0, body) != crc:
+                    self.rx = self.rx[1:]
+                    continue
+                self.rx = self.rx[4 + n:]
+                payload = body[2:]
+                if rop == CMD_ERROR | REPLY and payload[0] == op:
+                    raise RuntimeError(ERRORS.get(payload[1], "error %d" % payload[1]))
+                if rop == op | REPLY:
+                    return payload
+        raise RuntimeError("no reply")
+
+# struct health in nixie.h, without crc
+RESET_CAUSES = ["other", "power-on", "external", "brown-out", "watchdog"]
+EVENTS = ["i2c error", "twi reset", "op dropped", "rtc mismatch", "sqw lost"]
+HEALTH_LAST = 4
+
+
+def print_health(r):
+    n = len(RESET_CAUSES) + len(EVENTS)
+    counts = struct.unpack_from("<%dH" % n, r)
+    print("resets:")
+    for name, c in zip(RESET_CAUSES, counts):
+        print("  %-14s %d" % (name, c))
+    print("events:")
+    for name, c in zip(EVENTS, counts[len(RESET_CAUSES):]):
+        print("  %-14s %d" % (name, c))
+    last = []
+    for i in range(HEALTH_LAST):
+        cause, pc = struct.unpack_from("<BH", r, 2 * n + 3 * i)
+        name = RESET_CAUSES[cause] if cause < len(RESET_CAUSES) else "0x%02x" % cause
+        last.append(name + (" at 0x%04x" % pc if name == "watchdog" else ""))
+    print("last resets: %s" % ", ".join(last))
+
+
+def main(argv):
+    if len(argv) < 3:
+        sys.exit(__doc__)
+    port, cmd, args = Port(argv[1]), argv[2], argv[3:]
+
+    if cmd == "version":
+        print(port.request(CMD_VERSION).decode())
+    elif cmd == "time":
+        print("%02d:%02d:%02d" % tuple(port.request(CMD_GET_TIME)))
+    elif cmd == "settime":
+        if args:
+            hms = [int(x) for x in args[0].split(":")]
+        else:
+            t = time.localtime()
+            hms = [t.tm_hour, t.tm_min, t.tm_sec]
+        port.request(CMD_SET_TIME, bytes(hms))
+    elif cmd == "sync":
+        latency = float(args[0]) / 1000 if args else 0.0
+        # time to shift the request out at 115200 8N1
+        wire = len(frame(CMD_SET_TIME_AT, bytes(5))) * 10 / 115200
+        edge = int(time.time()) + 1
+        if edge - time.time() < 0.1:
+            edge += 1
+        t = time.localtime(edge)
+        ms = round((edge - time.time() - wire - latency) * 1000)
+        port.request(CMD_SET_TIME_AT, bytes([t.tm_hour, t.tm_min, t.tm_sec, ms & 0xFF, ms >> 8]))
+        print("%02d:%02d:%02d set in %d ms" % (t.tm_hour, t.tm_min, t.tm_sec, ms))
+    elif cmd == "get":
+        pid, val = port.request(CMD_GET_PARAM, bytes([int(args[0], 0)]))
+        print("%s: %d" % (PARAMS.get(pid, "0x%02x" % pid), val))
+    elif cmd == "set":
+        pid, val = port.request(CMD_SET_PARAM, bytes([int(args[0], 0), int(args[1], 0)]))
+        print("%s: %d" % (PARAMS.get(pid, "0x%02x" % pid), val))
+    elif cmd == "config":
+        r = port.request(CMD_DUMP_CONFIG)
+        for pid, val in zip(r[0::2], r[1::2]):
+            print("0x%02x %-20s %d" % (pid, PARAMS.get(pid, ""), val))
+    elif cmd == "health":
+        if args == ["clear"]:
+            port.request(CMD_CLEAR_HEALTH)
+        print_health(port.request(CMD_GET_HEALTH))
+    else:
+        sys.exit(__doc__)
+
+
+if __name__ == "__main__":
+    try:
+        main(sys.argv)
+    except RuntimeError as e:
+        sys.exit("error: %s" % e)
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""Decode profiler dump produced by `make PROFILE=1` firmware.
+
+usage:
+    profdecode.py /dev/ttyUSB0        send 'P' and decode reply
+    profdecode.py dump.bin            decode previously captured dump
+
+Durations are printed in microseconds, min and max saturate at 32ms and
+are printed as ">32767". Display ISR latency (compare match to
+TIMER1_COMPB_vect entry) has Timer1 resolution, 4us.
+"""
+
+import os
+import stat
+import struct
+import sys
+import termios
+import time
+
+# keep in sync with enum prof_id in profile.h
+NAMES = [
+    "TIMER1_COMPB_vect",
+    "TIMER1_OVF_vect",
+    "TIMER0_OVF_vect",
+    "USART_RX_vect",
+    "USART_UDRE_vect",
+    "TWI_vect",
+    "INT0_vect",
+    "PCINT_vect",
+    "bottom_half",
+    "ds3231_sync",
+    "refresh",
+    "animate",
+    "paint",
+]
+
+RECORD = struct.Struct("<HHIHH")  # min, max, sum, count, overruns
+LATENCY = struct.Struct("<HH")  # min, max
+TICK_US = 0.5
+SATURATED = 0xFFFF
+LATENCY_US = 4
+
+
+def crc8_ccitt(crc, data):
+    # same as avr-libc _crc8_ccitt_update()
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xff if crc & 0x80 else (crc << 1) & 0xff
+    return crc
+
+
+def read_serial(path):
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+    attr = termios.tcgetattr(fd)
+    attr[0] = attr[1] = attr[3] = 0
+    attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+    attr[4] = attr[5] = termios.B115200
+    termios.tcsetattr(fd, termios.TCSANOW, attr)
+    termios.tcflush(fd, termios.TCIOFLUSH)
+    os.write(fd, b"P")
+    data = b""
+    deadline = time.time() + 2
+    while time.time() < deadline:
+        data += os.read(fd, 4096)
+        if b"PROF" in data and len(data) - data.index(b"PROF") >= \
+                6 + data[data.index(b"PROF") + 4] * RECORD.size + LATENCY.size:
+            break
+    os.close(fd)
+    return data
+
+
+def us(ticks):
+    return ">%d" % (ticks * TICK_US) if ticks == SATURATED else "%.1f" % (ticks * TICK_US)
+
+
+def decode(data):
+    i = data.find(b"PROF")
+    if i < 0:
+        sys.exit("no profile record found")
+    n = data[i + 4]
+    end = i + 5 + n * RECORD.size + LATENCY.size
+    if len(data) < end + 1:
+        sys.exit("truncated profile record")
+    if crc8_ccitt(0, data[i:end]) != data[end]:
+        sys.exit("profile record crc mismatch")
+
+    print("%-18s %8s %9s %9s %9s %9s" % ("handler", "calls", "min us", "avg us", "max us", "overruns"))
+    for k in range(n):
+        mn, mx, total, count, over = RECORD.unpack_from(data, i + 5 + k * RECORD.size)
+        name = NAMES[k] if k < len(NAMES) else "#%d" % k
+        if count == 0:
+            print("%-18s %8s" % (name, "-"))
+            continue
+        print("%-18s %8d %9s %9.1f %9s %9d" % (
+            name, count, us(mn), total * TICK_US / count, us(mx), over))
+
+    mn, mx = LATENCY.unpack_from(data, end - LATENCY.size)
+    if mn > mx:
+        print("display ISR latency: -")
+    else:
+        print("display ISR latency: %d..%d us" % (mn * LATENCY_US, mx * LATENCY_US))
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit(__doc__)
+    path = sys.argv[1]
+    if stat.S_ISCHR(os.stat(path).st_mode):
+        data = read_serial(path)
+    else:
+        with open(path, "rb") as f:
+            data = f.read()
+    decode(data)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,215 @@
+#!/usr/bin/env python3
+"""Worst case stack depth of AVR firmware.
+
+usage: stackcheck.py [-v] [--heap N] [--max N] [--icall FUNC:TARGET ...] firmware.elf file.su ...
+
+Frame sizes come from gcc -fstack-usage (.su files, they include pushed
+registers and return address). Functions without .su (avr-libc, libgcc)
+are estimated from their prologue in `avr-objdump -d`. The call graph is
+built from call/rcall/jmp/rjmp in the disassembly; roots are main() and
+every ISR.
+
+Indirect calls can't be followed: every function containing icall/ijmp
+needs --icall FUNC:TARGET, FUNC may be an avr-libc vector name
+(TWI_vect). Unresolved indirect calls and recursion are errors.
+
+Interrupts nest on top of main(). An ISR which may execute sei
+(ISR_NOBLOCK, or sei() anywhere in its call tree) may itself be
+interrupted, so the bound is
+
+    main + sum(nesting ISRs) + max(other ISRs)
+
+It must fit between the end of .bss plus --heap bytes (malloc from
+fdevopen()) and RAMEND, or --max if given. Exit status is 1 otherwise.
+"""
+
+import argparse
+import re
+import subprocess
+import sys
+
+RAMEND = 0x8FF  # ATmega328P
+
+VECTORS = [
+    "RESET", "INT0_vect", "INT1_vect", "PCINT0_vect", "PCINT1_vect",
+    "PCINT2_vect", "WDT_vect", "TIMER2_COMPA_vect", "TIMER2_COMPB_vect",
+    "TIMER2_OVF_vect", "TIMER1_CAPT_vect", "TIMER1_COMPA_vect",
+    "TIMER1_COMPB_vect", "TIMER1_OVF_vect", "TIMER0_COMPA_vect",
+    "TIMER0_COMPB_vect", "TIMER0_OVF_vect", "SPI_STC_vect",
+    "USART_RX_vect", "USART_UDRE_vect", "USART_TX_vect", "ADC_vect",
+    "EE_READY_vect", "ANALOG_COMP_vect", "TWI_vect", "SPM_READY_vect",
+]
+
+
+def symbol(name):
+    """avr-libc vector name to __vector_N"""
+    if name in VECTORS:
+        return "__vector_%d" % VECTORS.index(name)
+    return name
+
+
+def pretty(name):
+    m = re.match(r"__vector_(\d+)$", name)
+    return VECTORS[int(m.group(1))] if m else name
+
+
+def read_su(paths):
+    frames = {}
+    for path in paths:
+        for line in open(path):
+            loc, size, kind = line.rstrip("\n").split("\t")
+            name = loc.rsplit(":", 1)[1]
+            if kind != "static":
+                print("warning: %s has %s stack usage" % (name, kind))
+            frames[name] = max(frames.get(name, 0), int(size))
+    return frames
+
+
+FUNC = re.compile(r"^[0-9a-f]+ <([^>]+)>:$")
+INSN = re.compile(r"^\s+[0-9a-f]+:\s+(?:[0-9a-f]{2} )+\s*(\S+)\s*([^;]*)(?:;\s*(.*))?$")
+TARGET = re.compile(r"<([^>+]+)(\+0x[0-9a-f]+)?>")
+
+
+def disassemble(elf):
+    """returns {function: [(mnemonic, operands, comment)]}"""
+    funcs, cur = {}, None
+    out = subprocess.run(["avr-objdump", "-d", elf], capture_output=True, text=True, check=True)
+    for line in out.stdout.splitlines():
+        m = FUNC.match(line)
+        if m:
+            cur = funcs.setdefault(m.group(1), [])
+            continue
+        m = INSN.match(line)
+        if m and cur is not None:
+            cur.append((m.group(1), m.group(2).strip(), m.group(3) or ""))
+    return funcs
+
+
+def estimate(insns):
+    """frame of a function without .su: pushes + frame allocation + return address"""
+    pushes = frame = 0
+    ldi = {}
+    for op, args, comment in insns:
+        if op == "push":
+            pushes += 1
+        elif op == "ldi":
+            reg, val = [a.strip() for a in args.split(",")]
+            ldi[reg] = int(val, 0)
+        elif op == "sbiw" and args.startswith("r28"):
+            frame += int(args.split(",")[1], 0)
+        elif op in ("jmp", "rjmp") and "__prologue_saves__" in comment:
+            # enters push sequence of r2..r17, r28, r29 at offset, frame size in r27:r26
+            m = re.search(r"__prologue_saves__\+0x([0-9a-f]+)", comment)
+            skipped = int(m.group(1), 16) // 2 if m else 0
+            pushes += 18 - skipped
+            frame += ldi.get("r26", 0) | ldi.get("r27", 0) << 8
+        elif op in ("ret", "reti"):
+            break
+    return pushes + frame + 2
+
+
+def graph(funcs, icall):
+    calls, sei, unresolved = {}, set(), []
+    for name, insns in funcs.items():
+        out = set()
+        for op, args, comment in insns:
+            if op in ("call", "rcall", "jmp", "rjmp"):
+                m = TARGET.search(comment or args)
+                if m and m.group(2) is None and m.group(1) != name and m.group(1) in funcs:
+                    out.add(m.group(1))
+            elif op in ("icall", "ijmp", "eicall", "eijmp"):
+                if name in icall:
+                    out |= icall[name]
+                else:
+                    unresolved.append(name)
+            elif op == "sei":
+                sei.add(name)
+        calls[name] = out
+    return calls, sei, unresolved
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("-v", "--verbose", action="store_true")
+    ap.add_argument("--heap", type=int, default=32)
+    ap.add_argument("--max", type=int)
+    ap.add_argument("--icall", action="append", default=[])
+    ap.add_argument("elf")
+    ap.add_argument("su", nargs="*")
+    opt = ap.parse_args()
+
+    icall = {}
+    for spec in opt.icall:
+        f, t = spec.split(":")
+        icall.setdefault(symbol(f), set()).add(symbol(t))
+
+    frames = read_su(opt.su)
+    funcs = disassemble(opt.elf)
+    calls, sei, unresolved = graph(funcs, icall)
+    for name in unresolved:
+        print("error: indirect call in %s, add --icall %s:TARGET" % (pretty(name), pretty(name)))
+    missing = set().union(*icall.values()) - set(funcs) if icall else set()
+    for name in missing:
+        print("error: --icall target %s is not in firmware" % pretty(name))
+    if unresolved or missing:
+        return 1
+
+    def frame(f):
+        return frames[f] if f in frames else estimate(funcs[f])
+
+    memo = {}
+
+    def depth(f, stack=()):
+        """worst depth below f and the path to it"""
+        if f in stack:
+            raise RecursionError(" -> ".join(pretty(x) for x in stack + (f,)))
+        if f not in memo:
+            best = (0, [])
+            for c in calls.get(f, ()):
+                best = max(best, depth(c, stack + (f,)))
+            memo[f] = (frame(f) + best[0], [f] + best[1])
+        return memo[f]
+
+    def nests(f, seen=None):
+        seen = seen if seen is not None else set()
+        if f in sei:
+            return True
+        seen.add(f)
+        return any(nests(c, seen) for c in calls.get(f, ()) if c not in seen)
+
+    try:
+        roots = ["main"] + sorted((f for f in funcs if re.match(r"__vector_\d+$", f)),
+                                  key=lambda f: int(f.split("_")[-1]))
+        result = {f: depth(f) for f in roots}
+    except RecursionError as e:
+        print("error: recursion %s" % e)
+        return 1
+
+    print("%-22s %6s  %s" % ("root", "bytes", "worst path"))
+    for f in roots:
+        d, path = result[f]
+        tag = " (nests)" if f != "main" and nests(f) else ""
+        print("%-22s %6d  %s%s" % (pretty(f), d, " > ".join(pretty(x) for x in path), tag))
+        if opt.verbose:
+            for x in path:
+                print("%30s %4d%s" % (pretty(x), frame(x), "" if x in frames else " (estimated)"))
+
+    isrs = roots[1:]
+    nesting = sum(result[f][0] for f in isrs if nests(f))
+    other = max([result[f][0] for f in isrs if not nests(f)] or [0])
+    worst = result["main"][0] + nesting + other
+
+    nm = subprocess.run(["avr-nm", opt.elf], capture_output=True, text=True, check=True).stdout
+    heap_start = int(re.search(r"^([0-9a-f]+) \S __heap_start$", nm, re.M).group(1), 16) & 0xFFFF
+    room = opt.max if opt.max is not None else RAMEND + 1 - heap_start - opt.heap
+
+    print("worst case: main %d + nesting ISRs %d + other ISR %d = %d bytes, room %d bytes"
+          % (result["main"][0], nesting, other, worst, room))
+    if worst > room:
+        print("error: stack may collide with heap/.bss")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
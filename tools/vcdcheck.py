@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+"""Display timing invariants of a simulator VCD trace (sim/bench -w).
+
+usage: vcdcheck.py [-v] --board ncm109|oc2cpu --freq F --duty D [--skip MS] [--slack N] trace.vcd
+
+F and D are tube_pwm_freq and tube_pwm_duty the firmware ran with
+(sim/bench -f/-d), tube_trim is assumed to be at default 100%.
+
+ncm109, LE is PB2 (OC1B):
+    every SPI shift (spi_busy high) starts after LE falls and ends
+    before LE rises again, so HV5122 latches never see a half shifted
+    frame; LE period is the Timer1 period of F and its high time is
+    OCR1B + 1 counts, OCR1B capped at TOP - LE_OFF_MIN. D 0 turns OC1B
+    off, only the shift is checked.
+
+oc2cpu, anodes are PD6/PD5/PD3, mux lines PC0..PC3 and PB0..PB3:
+    no anode is on while a mux line changes (ghosting); every anode
+    repeats every 3 Timer1 periods and is on for TOP + 1 - OCR1B counts.
+
+Period and on time are medians, ISRs held off by other ISRs move single
+edges. They must be within one timer count (64 cycles) plus --slack
+cycles (ISR entry latency) of firmware arithmetic. Edges in the first
+--skip ms (boot, tube_init() clearing HV5122) are ignored.
+
+Exit status is 1 if any check fails.
+"""
+
+import argparse
+import bisect
+import re
+import statistics
+import sys
+
+F_CPU = 16000000
+COUNT = 64  # Timer1 runs at clk_IO/64
+BLANK_MIN = 16  # oc2cpu.c
+LE_OFF_MIN = 9  # ncm109.c
+
+UNITS = {"s": 1, "ms": 1e-3, "us": 1e-6, "ns": 1e-9, "ps": 1e-12, "fs": 1e-15}
+
+
+def read_vcd(path):
+    """returns {name: [(cycle, value)]}, value is an int, x/z read as 0"""
+    ids, changes, scale, t = {}, {}, 1e-9, 0
+    text = open(path).read()
+    m = re.search(r"\$timescale\s+(\d+)\s*(\w+)\s+\$end", text)
+    if m:
+        scale = int(m.group(1)) * UNITS[m.group(2)]
+    for m in re.finditer(r"\$var\s+\S+\s+\d+\s+(\S+)\s+(\S+)(?:\s+\[[^\]]*\])?\s+\$end", text):
+        ids[m.group(1)] = m.group(2)
+        changes[m.group(2)] = []
+    body = text[text.index("$enddefinitions"):].split("$end", 1)[1]
+    for tok in re.finditer(r"#(\d+)|b([01xz]+)\s+(\S+)|([01xz])(\S+)", body):
+        if tok.group(1) is not None:
+            t = round(int(tok.group(1)) * scale * F_CPU)
+            continue
+        if tok.group(2) is not None:
+            bits, vid = tok.group(2), tok.group(3)
+        else:
+            bits, vid = tok.group(4), tok.group(5)
+        if vid in ids:
+            changes[ids[vid]].append((t, int(re.sub("[xz]", "0", bits), 2)))
+    return changes
+
+
+def level(changes, t):
+    """value just before cycle t"""
+    i = bisect.bisect_left(changes, (t, -1))
+    return changes[i - 1][1] if i else 0
+
+
+def between(changes, a, b):
+    """values set in cycles a..b"""
+    return [x for _, x in changes[bisect.bisect_left(changes, (a, -1)):
+                                  bisect.bisect_right(changes, (b, 1 << 32))]]
+
+
+def edges(changes, skip, rising=True):
+    out, prev = [], 0
+    for c, x in changes:
+        if x != prev and bool(x) == rising and c >= skip:
+            out.append(c)
+        prev = x
+    return out
+
+
+def pulses(changes, skip):
+    """(rise, fall) pairs of a signal, starting after skip"""
+    out, start, prev = [], None, 0
+    for c, x in changes:
+        if x and not prev:
+            start = c
+        elif prev and not x and start is not None and start >= skip:
+            out.append((start, c))
+        prev = x
+    return out
+
+
+def percent(top, p):
+    """pwm_percent() in main.c"""
+    hundreds = top // 100
+    return hundreds * p + (top - hundreds * 100) * p // 100
+
+
+class Checker:
+    def __init__(self, opt):
+        self.opt = opt
+        self.failed = 0
+        self.tol = COUNT + opt.slack
+
+    def fail(self, msg):
+        if self.failed < 10:
+            print("%s: %s" % (self.opt.vcd, msg))
+        self.failed += 1
+
+    def timing(self, name, changes, period, on):
+        rises = edges(changes, self.skip)
+        highs = [b - a for a, b in pulses(changes, self.skip)]
+        if len(rises) < 3 or not highs:
+            self.fail("%s: %d pulses, trace too short?" % (name, len(highs)))
+            return
+        p = statistics.median(b - a for a, b in zip(rises, rises[1:]))
+        h = statistics.median(highs)
+        if self.opt.verbose:
+            print("%s: period %d cycles (%d), on %d cycles (%d)" % (name, p, period, h, on))
+        if abs(p - period) > self.tol:
+            self.fail("%s: period %d cycles, expected %d (%.1fHz vs %.1fHz)"
+                      % (name, p, period, F_CPU / p, F_CPU / period))
+        if abs(h - on) > self.tol:
+            self.fail("%s: on %d cycles, expected %d (duty %.1f%% vs %.1f%%)"
+                      % (name, h, on, 100.0 * h / p, 100.0 * on / period))
+
+    def ncm109(self, sig):
+        le, busy = sig["PB2"], sig["spi_busy"]
+        shifts = pulses(busy, self.skip)
+        if not shifts:
+            self.fail("no SPI shift")
+        for start, end in shifts:
+            # LE low before the first bit and until after the last one
+            if level(le, start) or any(between(le, start, end)):
+                self.fail("SPI shift %d..%d overlaps LE high" % (start, end))
+
+        if self.opt.duty == 0:
+            return
+        top = self.top
+        c = min(percent(top, self.opt.duty), top - LE_OFF_MIN)
+        self.timing("LE", le, (top + 1) * COUNT, (c + 1) * COUNT)
+
+    def oc2cpu(self, sig):
+        anodes = ["PD6", "PD5", "PD3"]
+        mux = ["PC%d" % i for i in range(4)] + ["PB%d" % i for i in range(4)]
+        changes = sorted({c for m in mux for c, _ in sig[m] if c >= self.skip})
+        for t in changes:
+            on = [a for a in anodes if level(sig[a], t) or level(sig[a], t + 1)]
+            if on:
+                self.fail("mux changes at cycle %d while %s on" % (t, "/".join(on)))
+
+        top = self.top
+        c = max(percent(top, 100 - self.opt.duty), BLANK_MIN)
+        for a in anodes:
+            self.timing(a, sig[a], 3 * (top + 1) * COUNT, (top + 1 - c) * COUNT)
+
+    def run(self):
+        opt = self.opt
+        self.top = F_CPU // COUNT // (opt.freq * 10) - 1  # PWM_TOP() in main.c
+        self.skip = opt.skip * F_CPU // 1000
+        sig = read_vcd(opt.vcd)
+        getattr(self, opt.board)(sig)
+        print("%s: %s freq %dHz duty %d%%: %s" % (opt.vcd, opt.board, opt.freq * 10, opt.duty,
+                                                  "%d failed" % self.failed if self.failed else "ok"))
+        return 1 if self.failed else 0
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("-v", "--verbose", action="store_true")
+    ap.add_argument("--board", choices=["ncm109", "oc2cpu"], required=True)
+    ap.add_argument("--freq", type=int, required=True)
+    ap.add_argument("--duty", type=int, required=True)
+    ap.add_argument("--skip", type=int, default=20)
+    ap.add_argument("--slack", type=int, default=256)
+    ap.add_argument("vcd")
+    return Checker(ap.parse_args()).run()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
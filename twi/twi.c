@@ -0,0 +1,141 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/twi.h>
+#include <stddef.h>
+
+#include "twi.h"
+#include "../profile.h"
+#include "../load.h"
+typedef unsigned char u8;
+
+#ifndef TWI_QUEUE_BITS
+#define TWI_QUEUE_BITS 2
+#endif
+#define QUEUE_MASK (_BV(TWI_QUEUE_BITS) - 1)
+
+static struct twi_req *queue[_BV(TWI_QUEUE_BITS)];
+static volatile u8 q_start, q_end;
+static u8 ix, reg_sent;
+
+#define TWCR_GO _BV(TWINT)|_BV(TWEN)|_BV(TWIE)
+
+static void
+start()
+{
+	ix = 0;
+	reg_sent = 0;
+	TWCR = TWCR_GO|_BV(TWSTA);
+}
+
+static void
+finish(struct twi_req *req, u8 status)
+{
+	u8 s = (q_start + 1) & QUEUE_MASK;
+	q_start = s;
+
+	/* STOP, followed by START if there is more work */
+	if (s != q_end) {
+		TWCR = TWCR_GO|_BV(TWSTO)|_BV(TWSTA);
+		ix = 0;
+		reg_sent = 0;
+	} else {
+		TWCR = _BV(TWINT)|_BV(TWEN)|_BV(TWSTO);
+	}
+
+	req->status = status;
+	if (req->done)
+		req->done(req);
+}
+
+ISR(TWI_vect)
+{
+	IDLE_WAKE();
+	PROFILE_SCOPE(PROF_TWI);
+	struct twi_req *req = queue[q_start];
+	u8 twsr = TW_STATUS;
+
+	switch (twsr) {
+	case TW_START:
+		TWDR = req->addr << 1 | TW_WRITE;
+		TWCR = TWCR_GO;
+		return;
+	case TW_REP_START:
+		TWDR = req->addr << 1 | TW_READ;
+		TWCR = TWCR_GO;
+		return;
+	case TW_MT_SLA_ACK:
+		TWDR = req->reg;
+		TWCR = TWCR_GO;
+		return;
+	case TW_MT_DATA_ACK:
+		/* read of 0 bytes stops here: receiver can't NACK nothing */
+		if (!reg_sent && (req->flags & TWI_READ) && req->len) {
+			reg_sent = 1;
+			TWCR = TWCR_GO|_BV(TWSTA);
+			return;
+		}
+		reg_sent = 1;
+		if (ix < req->len) {
+			TWDR = req->buf[ix++];
+			TWCR = TWCR_GO;
+			return;
+		}
+		finish(req, TWI_DONE);
+		return;
+	case TW_MR_DATA_ACK:
+		req->buf[ix++] = TWDR;
+		/* fallthrough */
+	case TW_MR_SLA_ACK:
+		/* NACK the last byte */
+		TWCR = ix + 1 < req->len ? TWCR_GO|_BV(TWEA) : TWCR_GO;
+		return;
+	case TW_MR_DATA_NACK:
+		req->buf[ix++] = TWDR;
+		finish(req, TWI_DONE);
+		return;
+	default:
+		req->twsr = twsr;
+		finish(req, TWI_ERROR);
+		return;
+	}
+}
+
+char
+twi_submit(struct twi_req *req)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		u8 e = q_end;
+		if (((e + 1) & QUEUE_MASK) == q_start)
+			return 0;
+
+		req->status = TWI_PENDING;
+		queue[e] = req;
+		q_end = (e + 1) & QUEUE_MASK;
+		if (e == q_start) /* engine was idle */
+			start();
+	}
+	return 1;
+}
+
+void
+twi_reset()
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		TWCR = 0;
+		while (q_start != q_end) {
+			struct twi_req *req = queue[q_start];
+			q_start = (q_start + 1) & QUEUE_MASK;
+			req->twsr = 0xff;
+			req->status = TWI_ERROR;
+		}
+		TWCR = _BV(TWEN);
+	}
+}
+
+void
+twi_init_twbr(unsigned char twbr)
+{
+	TWBR = twbr;
+	TWCR = _BV(TWEN);
+}
@@ -0,0 +1,40 @@
+#ifndef TWI_H
+#define TWI_H
+
+/*
+  Interrupt driven TWI master.
+
+  Requests are queued by twi_submit() and executed one after another
+  by TWI_vect. Each request is "write register pointer" followed either
+  by `len` bytes written, or by repeated start and `len` bytes read.
+  A read with `len` 0 only sets the register pointer.
+  Request memory must stay valid until status leaves TWI_PENDING.
+ */
+
+#define TWI_READ 1
+
+enum twi_status {
+	TWI_IDLE,
+	TWI_PENDING,
+	TWI_DONE,
+	TWI_ERROR,
+};
+
+struct twi_req {
+	unsigned char addr;	/* 7-bit slave address */
+	unsigned char reg;	/* register pointer */
+	unsigned char flags;	/* TWI_READ */
+	unsigned char len;
+	unsigned char *buf;
+	void (*done)(struct twi_req *); /* called from TWI_vect, may be NULL */
+	volatile unsigned char status;
+	unsigned char twsr;	/* TW_STATUS which caused TWI_ERROR */
+};
+
+#define twi_init(scl_freq) twi_init_twbr((F_CPU / (scl_freq) - 16) / 2)
+void twi_init_twbr(unsigned char twbr);
+
+char twi_submit(struct twi_req *req); /* returns 0 if queue is full */
+void twi_reset(); /* abort everything, pending requests fail with twsr = 0xff */
+
+#endif
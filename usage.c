@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "avr/io.h"
+#include "avr/eeprom.h"
+#include "util/crc16.h"
+
+#include "nixie.h"
+
+/*
+  Cathode usage histogram.
+
+  Main loop samples displayed digits every USAGE_SAMPLE seconds, the
+  period is prime, so samples walk over all seconds of a minute. Every
+  tube has a byte counter per cathode, when one of them saturates all
+  counters of that tube are halved: ratios stay, old history decays.
+
+  Table lives at USAGE_EEPROM with crc8 in the last byte, it is saved
+  every USAGE_SAVE samples (~1h), so a cell is written at most once an
+  hour. usage_poll() writes one byte at a time with journal_put_byte().
+  A sample taken during save restarts it.
+ */
+
+#define USAGE_SAVE 16
+
+static uint8_t usage[USAGE_TUBES][10];
+static uint8_t saved_crc; // of usage, written after it
+static unsigned char save_ix = sizeof usage + 1; // next byte to write
+static unsigned char samples;
+
+static uint8_t
+usage_crc(const uint8_t *p)
+{
+        uint8_t crc = 0;
+        for (unsigned char i = 0; i < sizeof usage; i++)
+                crc = _crc8_ccitt_update(crc, p[i]);
+        return crc;
+}
+
+// at boot, table stays zero if EEPROM copy is torn or was never written
+void
+usage_init()
+{
+        uint8_t buf[sizeof usage + 1];
+        eeprom_busy_wait();
+        eeprom_read_block(buf, (void *)USAGE_EEPROM, sizeof buf);
+        if (buf[sizeof usage] == usage_crc(buf))
+                memcpy(usage, buf, sizeof usage);
+}
+
+// digit[] holds what every tube shows, values above 9 are blank
+void
+usage_sample(const char *digit)
+{
+        for (unsigned char i = 0; i < USAGE_TUBES; i++) {
+                uint8_t *u = usage[i];
+                unsigned char d = digit[i];
+                if (d > 9)
+                        continue;
+                if (u[d] == 0xff)
+                        for (unsigned char c = 0; c < 10; c++)
+                                u[c] >>= 1;
+                u[d]++;
+        }
+
+        if (++samples >= USAGE_SAVE)
+                samples = 0;
+        else if (save_ix > sizeof usage)
+                return;
+        saved_crc = usage_crc(&usage[0][0]);
+        save_ix = 0;
+}
+
+// main context: continues background save
+void
+usage_poll()
+{
+        if (save_ix > sizeof usage)
+                return;
+        uint8_t b = save_ix < sizeof usage ? (&usage[0][0])[save_ix] : saved_crc;
+        if (journal_put_byte((uint8_t *)USAGE_EEPROM + save_ix, b))
+                save_ix++;
+}
+
+// credit[c] is how far cathode c of tube is behind the most used one
+void
+usage_deficit(unsigned char tube, uint8_t *credit)
+{
+        uint8_t max = 0;
+        for (unsigned char c = 0; c < 10; c++)
+                if (usage[tube][c] > max)
+                        max = usage[tube][c];
+        for (unsigned char c = 0; c < 10; c++)
+                credit[c] = max - usage[tube][c];
+}
+
+void
+usage_print()
+{
+        printf_P(PSTR("cathode usage, 1 = %us of display:\n"), USAGE_SAMPLE);
+        for (unsigned char i = 0; i < USAGE_TUBES; i++) {
+                printf_P(PSTR("  tube %u:"), i);
+                for (unsigned char c = 0; c < 10; c++)
+                        printf_P(PSTR(" %3u"), usage[i][c]);
+                printf_P(PSTR("\n"));
+        }
+}
@@ -5,6 +5,8 @@
 #include <stdio.h>
 
 #include "uart.h"
+#include "../profile.h"
+#include "../load.h"
 typedef unsigned char u8;
 typedef unsigned int u16;
 
@@ -27,6 +29,8 @@ static volatile u8 tx_start, rx_end;
 
 ISR(USART_UDRE_vect)
 {
+	IDLE_WAKE();
+	PROFILE_SCOPE(PROF_USART_UDRE);
 	u8 s = tx_start;
 	UDR0 = tx_ring[s];
 	s = (s + 1) & RING_MASK;
@@ -43,7 +47,18 @@ uart_putchar(char c, FILE *stream __attribute__((unused)))
 	if (c == '\n')
 		uart_putchar('\r', NULL);
 #endif
- 	while (((tx_end + 1) & RING_MASK) == tx_start);
+	while (((tx_end + 1) & RING_MASK) == tx_start) {
+		/* ring is full: sleep until USART_UDRE_vect drains it.
+		   With interrupts off nothing would drain it, drop the char
+		   instead of hanging until watchdog fires. idle() counts
+		   the wait as idle time, like the main loop's. */
+		if (bit_is_clear(SREG, SREG_I))
+			return -1;
+		cli();
+		if (((tx_end + 1) & RING_MASK) == tx_start)
+			idle();
+		sei();
+	}
 
 	tx_ring[tx_end] = c;
 	tx_end = (tx_end + 1) & RING_MASK;
@@ -53,6 +68,8 @@ uart_putchar(char c, FILE *stream __attribute__((unused)))
 
 ISR(USART_RX_vect)
 {
+	IDLE_WAKE();
+	PROFILE_SCOPE(PROF_USART_RX);
 	char c = UDR0;
 	u8 e = rx_end;
 	if (((e + 1) & RING_MASK) == rx_start)
@@ -1,8 +1,8 @@
 #ifndef UART_H
 #define UART_H
 
-#include <math.h>
-#define uart_init(baud) uart_init_ubrr(fabs(F_CPU/(16 * (double)baud) - 1) + 0.5)
+/* UBRR0 = F_CPU / (16 * baud) - 1, rounded to nearest */
+#define uart_init(baud) uart_init_ubrr((F_CPU + 8UL * (baud)) / (16UL * (baud)) - 1)
 void uart_init_ubrr(unsigned int ubrr0);
 
 char uart_read_would_block();